@@ -0,0 +1,87 @@
+/*
+ * arch_timer.h - ARM generic timer access
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+
+/* Virtual count; CNTVOFF_EL2 is zeroed at boot so this matches the physical count */
+static inline u64 arch_counter_read(void)
+{
+	u64 cnt;
+	asm volatile ("mrs %0, cntvct_el0" : "=r" (cnt));
+	return cnt;
+}
+
+/* Counter frequency in Hz, as programmed by the firmware */
+static inline u64 arch_timer_freq(void)
+{
+	u64 freq;
+	asm volatile ("mrs %0, cntfrq_el0" : "=r" (freq));
+	return freq;
+}
+
+#define NSEC_PER_SEC            1000000000UL
+#define NSEC_PER_MSEC           1000000UL
+#define NSEC_PER_USEC           1000UL
+
+/* Counter frequency, cached by arch_timer_init() */
+extern u64 arch_timer_hz;
+
+/* Exact conversions, without a 128-bit division (there is no libgcc): whole
+ * seconds first, then the remainder, which is small enough for the multiply
+ * not to overflow. Ticks to ns rounds down and ns to ticks rounds up, so that
+ * a deadline converted to ticks is never reached early: by the time the
+ * counter gets there, ktime_get_ns() has reached the deadline too, however
+ * long the system has been up.
+ */
+static inline u64 arch_ticks_to_ns(u64 ticks)
+{
+	u64 sec = ticks / arch_timer_hz, rem = ticks % arch_timer_hz;
+
+	return sec * NSEC_PER_SEC + rem * NSEC_PER_SEC / arch_timer_hz;
+}
+
+static inline u64 arch_ns_to_ticks(u64 ns)
+{
+	u64 sec = ns / NSEC_PER_SEC, rem = ns % NSEC_PER_SEC;
+
+	return sec * arch_timer_hz + (rem * arch_timer_hz + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+}
+
+/* Clocksource: nanoseconds since the counter started */
+static inline u64 ktime_get_ns(void)
+{
+	return arch_ticks_to_ns(arch_counter_read());
+}
+
+/* Clockevent: CNTP, the EL1 physical timer, as a one-shot. There is no periodic
+ * tick; `event_handler' is called (from IRQ context, with the timer stopped)
+ * once the programmed deadline passes and is expected to program the next one.
+ */
+void arch_timer_init(void (*event_handler) (void));
+
+/* Enables the calling core's own CNTP interrupt, with the same event handler */
+void arch_timer_init_secondary(void);
+
+/* Fires the event handler once the counter reaches `ticks' (absolute);
+ * immediately if that's already in the past.
+ */
+void arch_timer_set_next_event(u64 ticks);
+void arch_timer_stop(void);
@@ -0,0 +1,235 @@
+/*
+ * atomic.h - atomic operations and SMP memory barriers
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+
+/* Barriers, between the cores (inner shareable) for the smp_ ones and against
+ * everything, devices included, for the plain ones.
+ */
+#define smp_mb()        asm volatile ("dmb ish" ::: "memory")
+#define smp_rmb()       asm volatile ("dmb ishld" ::: "memory")
+#define smp_wmb()       asm volatile ("dmb ishst" ::: "memory")
+#define mb()            asm volatile ("dsb sy" ::: "memory")
+#define rmb()           asm volatile ("dsb ld" ::: "memory")
+#define wmb()           asm volatile ("dsb st" ::: "memory")
+
+/* Against the compiler only, e.g. for something an IRQ on this core reads */
+#define barrier()       asm volatile ("" ::: "memory")
+
+/* Stops the compiler caching or tearing an access, nothing more */
+#define READ_ONCE(x)            (*(const volatile __typeof__(x) *) &(x))
+#define WRITE_ONCE(x, v)        do { *(volatile __typeof__(x) *) &(x) = (v); } while (0)
+
+/* Everything below works on naturally aligned 32- and 64-bit objects (ints,
+ * enums, pointers). The read-modify-write operations are both acquire and
+ * release, which orders them against each other and against any acquire or
+ * release access; put an smp_mb() next to one to also order plain accesses
+ * on either side against each other.
+ *
+ * ARMv8.0 (Cortex-A53/A72) only has the exclusives; with -march=armv8.1-a or
+ * later the compiler defines __ARM_FEATURE_ATOMICS and we use the single-
+ * instruction LSE forms instead, which don't retry under contention.
+ */
+
+static inline u32 __load_acquire32(const volatile u32 *p)
+{
+	u32 v;
+	asm volatile ("ldar %w0, %1" : "=r" (v) : "Q" (*p) : "memory");
+	return v;
+}
+
+static inline u64 __load_acquire64(const volatile u64 *p)
+{
+	u64 v;
+	asm volatile ("ldar %0, %1" : "=r" (v) : "Q" (*p) : "memory");
+	return v;
+}
+
+static inline void __store_release32(volatile u32 *p, u32 v)
+{
+	asm volatile ("stlr %w1, %0" : "=Q" (*p) : "r" (v) : "memory");
+}
+
+static inline void __store_release64(volatile u64 *p, u64 v)
+{
+	asm volatile ("stlr %1, %0" : "=Q" (*p) : "r" (v) : "memory");
+}
+
+/* `w' is the operand modifier for the register width: "w" or "" */
+#ifdef __ARM_FEATURE_ATOMICS
+
+#define __DEFINE_XCHG(bits, type, w)                                            \
+static inline type __xchg##bits(volatile type *p, type v)                       \
+{                                                                               \
+	type old;                                                               \
+	asm volatile ("swpal %" w "2, %" w "0, %1"                              \
+		      : "=&r" (old), "+Q" (*p) : "r" (v) : "memory");           \
+	return old;                                                             \
+}
+
+#define __DEFINE_CMPXCHG(bits, type, w)                                         \
+static inline type __cmpxchg##bits(volatile type *p, type old, type new)        \
+{                                                                               \
+	asm volatile ("casal %" w "0, %" w "2, %1"                              \
+		      : "+r" (old), "+Q" (*p) : "r" (new) : "memory");          \
+	return old;                                                             \
+}
+
+/* `lse' is the LD<op>AL instruction, `arg' how to get its operand from `v' */
+#define __DEFINE_FETCH_OP(name, llsc, lse, arg, bits, type, w)                  \
+static inline type __fetch_##name##bits(volatile type *p, type v)               \
+{                                                                               \
+	type old;                                                               \
+	asm volatile (lse " %" w "2, %" w "0, %1"                               \
+		      : "=&r" (old), "+Q" (*p) : "r" ((type) (arg)) : "memory"); \
+	return old;                                                             \
+}
+
+#else
+
+#define __DEFINE_XCHG(bits, type, w)                                            \
+static inline type __xchg##bits(volatile type *p, type v)                       \
+{                                                                               \
+	type old;                                                               \
+	u32 fail;                                                               \
+	asm volatile ("1:	ldaxr	%" w "0, %2\n"                          \
+		      "	stlxr	%w1, %" w "3, %2\n"                             \
+		      "	cbnz	%w1, 1b"                                        \
+		      : "=&r" (old), "=&r" (fail), "+Q" (*p) : "r" (v) : "memory"); \
+	return old;                                                             \
+}
+
+#define __DEFINE_CMPXCHG(bits, type, w)                                         \
+static inline type __cmpxchg##bits(volatile type *p, type old, type new)        \
+{                                                                               \
+	type was;                                                               \
+	u32 fail;                                                               \
+	asm volatile ("1:	ldaxr	%" w "0, %2\n"                          \
+		      "	cmp	%" w "0, %" w "3\n"                             \
+		      "	b.ne	2f\n"                                           \
+		      "	stlxr	%w1, %" w "4, %2\n"                             \
+		      "	cbnz	%w1, 1b\n"                                      \
+		      "2:"                                                      \
+		      : "=&r" (was), "=&r" (fail), "+Q" (*p)                    \
+		      : "r" (old), "r" (new) : "memory", "cc");                 \
+	return was;                                                             \
+}
+
+/* `llsc' is the ALU instruction combining the old value with `v' */
+#define __DEFINE_FETCH_OP(name, llsc, lse, arg, bits, type, w)                  \
+static inline type __fetch_##name##bits(volatile type *p, type v)               \
+{                                                                               \
+	type old, new;                                                          \
+	u32 fail;                                                               \
+	asm volatile ("1:	ldaxr	%" w "0, %3\n"                          \
+		      "	" llsc "	%" w "1, %" w "0, %" w "4\n"            \
+		      "	stlxr	%w2, %" w "1, %3\n"                             \
+		      "	cbnz	%w2, 1b"                                        \
+		      : "=&r" (old), "=&r" (new), "=&r" (fail), "+Q" (*p)       \
+		      : "r" (v) : "memory");                                    \
+	return old;                                                             \
+}
+
+#endif // __ARM_FEATURE_ATOMICS
+
+#define __DEFINE_ATOMIC_OPS(bits, type, w)                                      \
+	__DEFINE_XCHG(bits, type, w)                                            \
+	__DEFINE_CMPXCHG(bits, type, w)                                         \
+	__DEFINE_FETCH_OP(add, "add", "ldaddal", v, bits, type, w)              \
+	__DEFINE_FETCH_OP(sub, "sub", "ldaddal", -v, bits, type, w)             \
+	__DEFINE_FETCH_OP(or, "orr", "ldsetal", v, bits, type, w)               \
+	__DEFINE_FETCH_OP(and, "and", "ldclral", ~v, bits, type, w)             \
+	__DEFINE_FETCH_OP(andnot, "bic", "ldclral", v, bits, type, w)           \
+	__DEFINE_FETCH_OP(xor, "eor", "ldeoral", v, bits, type, w)
+
+__DEFINE_ATOMIC_OPS(32, u32, "w")
+__DEFINE_ATOMIC_OPS(64, u64, "")
+
+/* Size-generic front ends. These all evaluate to the type of `*p', minus any
+ * qualifiers, and only generate the access of the matching width.
+ */
+#define __sized_op(p, op32, op64)                                               \
+	__builtin_choose_expr(sizeof(*(p)) == 8, op64, op32)
+
+#define __unqual(p, x)      ((__typeof__(*(p) + 0)) (x))
+
+#define smp_load_acquire(p) __unqual(p, __sized_op(p,                           \
+	__load_acquire32((const volatile u32 *) (p)),                           \
+	__load_acquire64((const volatile u64 *) (p))))
+
+#define smp_store_release(p, v) __sized_op(p,                                   \
+	__store_release32((volatile u32 *) (p), (u32) (u64) (v)),               \
+	__store_release64((volatile u64 *) (p), (u64) (v)))
+
+/* Returns the old value */
+#define xchg(p, v) __unqual(p, __sized_op(p,                                    \
+	__xchg32((volatile u32 *) (p), (u32) (u64) (v)),                        \
+	__xchg64((volatile u64 *) (p), (u64) (v))))
+
+/* Stores `new' if `*p' was `old'; returns what `*p' was either way */
+#define cmpxchg(p, old, new) __unqual(p, __sized_op(p,                          \
+	__cmpxchg32((volatile u32 *) (p), (u32) (u64) (old), (u32) (u64) (new)), \
+	__cmpxchg64((volatile u64 *) (p), (u64) (old), (u64) (new))))
+
+#define __fetch_op(op, p, v) __unqual(p, __sized_op(p,                          \
+	__fetch_##op##32((volatile u32 *) (p), (u32) (u64) (v)),                \
+	__fetch_##op##64((volatile u64 *) (p), (u64) (v))))
+
+/* All of these return the old value */
+#define atomic_fetch_add(p, v)          __fetch_op(add, p, v)
+#define atomic_fetch_sub(p, v)          __fetch_op(sub, p, v)
+#define atomic_fetch_or(p, v)           __fetch_op(or, p, v)
+#define atomic_fetch_and(p, v)          __fetch_op(and, p, v)
+#define atomic_fetch_andnot(p, v)       __fetch_op(andnot, p, v)
+#define atomic_fetch_xor(p, v)          __fetch_op(xor, p, v)
+
+#define atomic_inc(p)                   ((void) atomic_fetch_add(p, 1))
+#define atomic_dec(p)                   ((void) atomic_fetch_sub(p, 1))
+
+/* Bit `nr' of a bitmap made of u64 words */
+#define BITS_PER_U64            64
+
+static inline void set_bit(unsigned nr, volatile u64 *map)
+{
+	__fetch_or64(&map[nr / BITS_PER_U64], 1UL << (nr % BITS_PER_U64));
+}
+
+static inline void clear_bit(unsigned nr, volatile u64 *map)
+{
+	__fetch_andnot64(&map[nr / BITS_PER_U64], 1UL << (nr % BITS_PER_U64));
+}
+
+static inline BOOL test_and_set_bit(unsigned nr, volatile u64 *map)
+{
+	u64 mask = 1UL << (nr % BITS_PER_U64);
+	return (__fetch_or64(&map[nr / BITS_PER_U64], mask) & mask) != 0;
+}
+
+static inline BOOL test_and_clear_bit(unsigned nr, volatile u64 *map)
+{
+	u64 mask = 1UL << (nr % BITS_PER_U64);
+	return (__fetch_andnot64(&map[nr / BITS_PER_U64], mask) & mask) != 0;
+}
+
+static inline BOOL test_bit(unsigned nr, const volatile u64 *map)
+{
+	return (map[nr / BITS_PER_U64] >> (nr % BITS_PER_U64)) & 1;
+}
@@ -0,0 +1,46 @@
+/*
+ * cpufreq.h - ARM clock scaling
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+#include "arch_timer.h"
+
+/* The four cores share one ARM clock, set through the firmware. A governor
+ * thread samples the busiest core's load and the SoC temperature every
+ * CPUFREQ_PERIOD_NS and picks a rate from CPUFREQ_STEP_HZ steps between the
+ * firmware's minimum and maximum:
+ *      - at or above the thermal limit (CPUFREQ_THERMAL_MARGIN below the
+ *        firmware's own, where it would start throttling): one step down
+ *      - within CPUFREQ_THERMAL_HYST of it: never up
+ *      - load above CPUFREQ_UP_LOAD: straight to the top
+ *      - load below CPUFREQ_DOWN_LOAD: one step down
+ */
+#define CPUFREQ_PERIOD_NS               (100 * NSEC_PER_MSEC)
+#define CPUFREQ_STEP_HZ                 100000000U
+#define CPUFREQ_MAX_LEVELS              32
+#define CPUFREQ_UP_LOAD                 80      // percent
+#define CPUFREQ_DOWN_LOAD               30
+#define CPUFREQ_THERMAL_MARGIN          5000    // millidegrees C
+#define CPUFREQ_THERMAL_HYST            5000
+
+/* Starts the governor; after firmware_info_fetch() and sched_init() */
+void cpufreq_init(void);
+
+void cpufreq_stats_dump(void);
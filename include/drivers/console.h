@@ -20,4 +20,58 @@
 
 #pragma once
 
+#include <stddef.h>
+#include "types.h"
 
+/* The kernel console, on the PL011 (uart0). Output goes into a ring that the
+ * UART's TX interrupt drains into its 16-byte FIFO, so writers only stall
+ * when the ring is full, and then only if they can afford to: */
+#define CONSOLE_TX_RING_SIZE    4096    // power of 2
+
+/* Input is drained from the RX FIFO a whole FIFO at a time into a ring of its
+ * own. The UART interrupt is the only producer; there must be only one
+ * consumer (the ConsoleReadInt handler, or a thread it wakes), which reads
+ * without taking any lock.
+ */
+#define CONSOLE_RX_RING_SIZE    1024    // power of 2
+
+/* Overflow policy: with the ring full, a writer in thread context with IRQs
+ * unmasked feeds the FIFO itself (polling, like the old console) until its
+ * text fits. Anyone else (interrupt context, IRQs masked, or before
+ * uart0_init() when nothing drains the ring) drops what doesn't fit; the
+ * bytes are counted in `dropped' and each such write in `overflows'.
+ */
+struct console_stats {
+	u64 queued;                     // bytes accepted into the ring
+	u64 written;                    // bytes handed to the FIFO
+	u64 dropped;
+	u64 overflows;
+	u64 stalls;                     // writes that had to wait for the FIFO
+	u64 tx_irqs;
+	u32 max_depth;                  // high-water mark of the ring
+};
+
+/* Kept by the RX ring's producer, the UART interrupt, alone */
+struct console_rx_stats {
+	u64 bytes;                      // bytes put in the RX ring
+	u64 dropped;                    // arrived with the RX ring full
+	u64 errors;                     // overrun, break, parity or framing error
+	u64 irqs;
+};
+
+void console_write(const char *s, size_t len);
+void console_putc(char c);
+
+/* Copy out up to `len' received bytes, without blocking; returns how many */
+size_t console_read(char *buf, size_t len);
+/* The next received byte, or -1 if there is none */
+int console_getc(void);
+size_t console_rx_pending(void);
+
+/* Stop buffering: write out what's queued and everything after it by polling,
+ * without taking the console lock. For crash paths, which may have
+ * interrupted a writer; there's no going back.
+ */
+void console_panic(void);
+
+void console_stats_dump(void);
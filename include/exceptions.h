@@ -33,7 +33,49 @@
  */
 #define SAVE_VFP_REGS_FROM_EL1
 
+/* Layout of the register frame built on the exception stack by the stubs in
+ * vectors.S (see `struct ExceptionFrame' below). The IRQ fast path only fills
+ * in the registers the AAPCS64 lets irq_handler() clobber (x0-x18, x29, x30)
+ * plus ELR/SPSR; the x19-x28 and sp_el0 slots are reserved but only written
+ * when the frame is handed off to irq_reschedule().
+ * NOTE: DO NOT CHANGE THESE WITHOUT UPDATING THE STRUCT!!
+ */
+#define FRAME_X(n)              ((n) * 8)
+#define FRAME_SP_EL0            (31 * 8)
+#define FRAME_ELR               (32 * 8)
+#define FRAME_SPSR              (33 * 8)
+#define FRAME_Q(n)              (34 * 8 + (n) * 16)
+#define FRAME_SIZE              FRAME_Q(32)
+
+/* Exception syndrome (ESR_EL1) fields, for SyncStub */
+#define ESR_EC_SHIFT            26
+#define ESR_EC_SVC64            0x15
+
+/* The FIQ stub runs on its own per-core stack and saves x0-x18, x30, all of
+ * q0-q31, FPSR and FPCR. An FIQ isn't a call: the interrupted code may have
+ * anything live in the vector registers (the upper halves of v8-v15
+ * included, which a C handler only preserves the low 64 bits of), and in the
+ * FP status and control.
+ */
+#define FIQ_STACK_SHIFT         12
+#define FIQ_STACK_SIZE          (1 << FIQ_STACK_SHIFT)
+#define FIQ_FRAME_SP            0x90            // after x2-x18, x30
+#define FIQ_FRAME_FPSR          0x98
+#define FIQ_FRAME_FPCR          0xA0
+#define FIQ_FRAME_Q(n)          (0xB0 + (n) * 16)
+#define FIQ_FRAME_SIZE          FIQ_FRAME_Q(32)
+
 #ifndef __ASSEMBLER__
+#include "types.h"
+
+struct ExceptionFrame {
+	u64 x[31];
+	u64 sp_el0;
+	u64 elr_el1;
+	u64 spsr_el1;
+	__uint128_t q[32];
+};
+
 #ifdef DEBUG
 struct ExceptionContext {
 	void *sp;
@@ -70,9 +112,70 @@ void call_KOS_handler(IntType which);
  */
 extern void register_isr(IntType which, int_handler_t handler);
 
+/* Device-level handlers, indexed by IRQ number (ARM_IRQ_* in bcm2835int.h/bcm2711int.h) */
+typedef void (*irq_handler_t) (void *arg);
+
+/* Installs `handler' for IRQ line `irq' and unmasks the line in the interrupt controller.
+ * `arg' is passed through to the handler untouched.
+ * Returns 0 on success, or -1 if `irq' is out of range or already has a handler.
+ */
+int request_irq(unsigned irq, irq_handler_t handler, void *arg);
+
+/* Masks IRQ line `irq' and removes its handler, returning once no core can
+ * still be running it (see synchronize_rcu()); not from interrupt context.
+ */
+void free_irq(unsigned irq);
+
+/* Sets the priority (see irqchip.h) of a line that has a handler; request_irq()
+ * starts every line off at IRQ_PRIO_DEFAULT. Anything less urgent than
+ * IRQ_PRIO_LOWEST gets IRQ_PRIO_LOWEST.
+ */
+void irq_set_priority(unsigned irq, u8 prio);
+
+/* A single line can be taken as an FIQ instead, which skips the controller
+ * acknowledge and the C dispatcher, and isn't held off by IRQ handlers,
+ * softirqs or irq_save(). The handler runs with everything masked, on a small
+ * stack (FIQ_STACK_SIZE), and can preempt any kernel code: it must not touch
+ * anything shared with the rest of the kernel except through single-word
+ * stores; hand further work off by raising an IRQ. Every core unmasks F once
+ * at bring-up (enable_fiq()); the local-timer and mailbox lines on the BCM2836
+ * are routed to the FIQ of the core that calls this.
+ * Returns 0 on success, or -1 if the line can't be routed to FIQ or another line
+ * already is.
+ */
+typedef void (*fiq_handler_t) (void *arg);
+
+int request_fiq(unsigned irq, fiq_handler_t handler, void *arg);
+void free_fiq(void);
+
+#ifdef FIQ_BENCH
+/* Times the virtual timer's line from its deadline to the handler, taken as an
+ * IRQ and then as an FIQ, on the calling core
+ */
+void fiq_bench(void);
+#endif
+
 _Noreturn void InvalidExceptionHandler(int type, int currentEL, struct ExceptionContext *context);
-/* Actual handler called by the stub in the hardware vector table */
-void irq_handler(void);
+/* Actual handler called by the stub in the hardware vector table. Returns nonzero
+ * if the interrupted context should be switched out, in which case the stub saves
+ * the rest of the frame and calls irq_reschedule() before returning.
+ */
+int irq_handler(u64 entry_ts);
+
+/* Ask for irq_reschedule() to be called on the way out of the current IRQ */
+void irq_set_need_resched(void);
+
+/* TRUE in hard IRQ handlers and softirqs */
+BOOL in_interrupt(void);
+
+/* Called with a full `struct ExceptionFrame' (callee-saved registers and sp_el0
+ * included) for the interrupted context. Whatever is left in *frame when this
+ * returns is what the stub restores and erets to.
+ */
+void irq_reschedule(struct ExceptionFrame *frame);
+
+/* Called by SyncStub with the full frame for an SVC from EL1 */
+void svc_handler(struct ExceptionFrame *frame);
 #endif // #ifndef __ASSEMBLER__
 
 
@@ -0,0 +1,64 @@
+/*
+ * fdt.h - flattened device tree parsing at boot
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+
+#define BOOT_MAX_MEM_RANGES     8
+#define BOOT_MAX_RESERVED       16
+#define BOOT_MODEL_LEN          64
+
+struct mem_range {
+	u64 base, size;
+};
+
+/* What the device tree the firmware handed _start says about the board.
+ * Filled in by fdt_parse() at EL2, before .bss is cleared, so it lives in
+ * .data. With no (or a bad) tree `valid' stays FALSE, everything else but
+ * `dtb_phys' is zero, and the compiled-in layout is all there is.
+ */
+struct boot_info {
+	BOOL valid;
+	u64 dtb_phys;
+	u32 dtb_size;
+	char model[BOOT_MODEL_LEN];
+
+	unsigned nr_mem;                                // /memory reg entries
+	struct mem_range mem[BOOT_MAX_MEM_RANGES];
+	unsigned nr_reserved;                           // /memreserve/ and /reserved-memory
+	struct mem_range reserved[BOOT_MAX_RESERVED];
+	BOOL truncated;                                 // more ranges than would fit
+
+	u64 mmio_base;                                  // where /soc maps bus 0x7E000000, or 0
+	unsigned nr_cpus;                               // /cpus/cpu@N nodes
+};
+
+extern struct boot_info boot_info;
+
+/* Called from _start with the firmware's x0, at EL2 with the MMU off: only
+ * physical addresses, no .bss, no literal pointers. Single pass over the
+ * structure block, nothing allocated.
+ */
+void fdt_parse(u64 dtb_phys);
+
+/* Total bytes of RAM the tree describes, minus the reserved ranges */
+u64 boot_mem_usable(void);
+
+void boot_info_dump(void);
@@ -0,0 +1,46 @@
+/*
+ * firmware.h - what the VideoCore firmware knows about the board
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+
+/* Fetched in a single mailbox message by firmware_info_fetch() at boot;
+ * `valid' is FALSE if the firmware didn't answer. Fields for tags it didn't
+ * answer individually stay 0.
+ */
+struct firmware_info {
+	BOOL valid;
+	u32 revision;
+	u32 board_model;
+	u32 board_revision;
+	u64 board_serial;
+	u8 mac[6];
+	u32 arm_mem_base, arm_mem_size;
+	u32 vc_mem_base, vc_mem_size;
+	u32 arm_clock, arm_clock_min, arm_clock_max;    // Hz
+	u32 core_clock;
+	u32 temp, temp_max;                             // millidegrees C
+};
+
+extern struct firmware_info firmware_info;
+
+/* Returns 0 once `firmware_info' is filled in, -1 if the firmware didn't answer */
+int firmware_info_fetch(void);
+void firmware_info_dump(void);
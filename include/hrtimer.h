@@ -0,0 +1,71 @@
+/*
+ * hrtimer.h - high-resolution one-shot timers
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+#include "arch_timer.h"
+
+enum hrtimer_restart {
+	HRTIMER_NORESTART,
+	HRTIMER_RESTART,        // callback moved `expires' forward, queue it again
+};
+
+struct hrtimer;
+typedef enum hrtimer_restart (*hrtimer_fn_t) (struct hrtimer *);
+
+struct hrtimer_base;
+
+/* Pending timers are kept in a per-core list sorted by expiry, and each core's
+ * generic timer is programmed for whichever of its own comes first; nothing
+ * fires while the list is empty. A timer fires on the core that last started
+ * it, with the callback in (hard) IRQ context at the timer's priority.
+ */
+struct hrtimer {
+	struct hrtimer *next;
+	u64 expires;            // absolute, in ktime_get_ns() nanoseconds
+	hrtimer_fn_t function;
+	struct hrtimer_base *base;      // whose list it's on (or was last on)
+	BOOL queued;
+};
+
+void hrtimers_init(void);
+
+/* Per-core part of hrtimers_init(), for the secondaries */
+void hrtimers_init_secondary(void);
+
+void hrtimer_init(struct hrtimer *timer, hrtimer_fn_t function);
+
+/* (Re)arms `timer' to fire at absolute time `expires' */
+void hrtimer_start(struct hrtimer *timer, u64 expires);
+
+static inline void hrtimer_start_rel(struct hrtimer *timer, u64 delta_ns)
+{
+	hrtimer_start(timer, ktime_get_ns() + delta_ns);
+}
+
+/* Returns TRUE if the timer was pending. Doesn't wait for a running callback
+ * (which may be on another core).
+ */
+BOOL hrtimer_cancel(struct hrtimer *timer);
+
+/* For periodic callbacks: pushes `expires' forward by whole `interval's until it
+ * is in the future, returning how many periods were skipped over (>= 1).
+ */
+u64 hrtimer_forward(struct hrtimer *timer, u64 now, u64 interval);
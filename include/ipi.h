@@ -0,0 +1,69 @@
+/*
+ * ipi.h - inter-processor interrupts
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+
+/* All IPIs share one SGI per core (mailbox 0 on the BCM2836, SGI 0 on the
+ * GIC); what it's for is a bit per request type in the target's pending
+ * mask. Only the request that finds the mask empty raises the interrupt, so
+ * any number of requests made to a core before it gets round to handling
+ * them cost it one.
+ */
+enum ipi_type {
+	IPI_RESCHEDULE,         // run the scheduler on the way out
+	IPI_CALL_FUNC,          // see smp_call_function_many()
+	IPI_TLB_FLUSH,          // see smp_tlb_flush_many()
+	IPI_SOFTIRQ,            // nothing: irq_handler() runs the pending softirqs anyway
+	NR_IPIS,
+};
+
+/* Registers the handler and enables it on core 0 / the calling secondary */
+void ipi_init(void);
+void ipi_init_secondary(void);
+
+void smp_send_reschedule(unsigned cpu);
+
+/* Interrupts the calling core, once it unmasks IRQs, to run its softirqs */
+void smp_send_softirq(void);
+
+/* Runs func(info) on each online core in `cpumask' (the caller's own too, if
+ * it's in there, directly) and waits for all of them to finish. Remote calls
+ * run in IRQ context. Must be called with IRQs unmasked: two cores calling
+ * each other with them masked would wait for each other forever.
+ */
+void smp_call_function_many(unsigned cpumask, void (*func) (void *), void *info);
+
+static inline void smp_call_function_single(unsigned cpu, void (*func) (void *), void *info)
+{
+	smp_call_function_many(1U << cpu, func, info);
+}
+
+/* Every other online core */
+void smp_call_function(void (*func) (void *), void *info);
+
+/* Has each online core in `cpumask' drop its whole TLB, returning once they
+ * all have. Anything the caller changed in the page tables beforehand is
+ * seen by the walks that follow. Same restriction on IRQs as above.
+ * Unmapping should go through tlbflush.h instead, which needs no IPIs.
+ */
+void smp_tlb_flush_many(unsigned cpumask);
+
+void ipi_stats_dump(void);
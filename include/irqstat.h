@@ -0,0 +1,69 @@
+/*
+ * irqstat.h - interrupt latency histograms
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+#include "arch_timer.h"
+
+/* Histograms are log2-bucketed in counter ticks (arch_counter_read()):
+ * bucket i counts samples in [2^i, 2^(i+1)), the last one everything above.
+ *
+ * A counter tick (52ns at 19.2MHz, 18.5ns at 54MHz) is longer than the vector
+ * stub itself takes, so built with IRQSTAT_CYCLES every stamp, including the
+ * stub's, comes from the PMU cycle counter instead and the histograms are in
+ * CPU cycles. That's the build to compare changes to the stubs with.
+ */
+#define IRQSTAT_BUCKETS         16
+
+/* Checked once per IRQ by irq_handler(); while this is FALSE the only cost
+ * is that check plus the counter read in the vector stub.
+ */
+extern volatile BOOL irqstat_enabled;
+
+#ifdef IRQSTAT_CYCLES
+static inline u64 irqstat_clock(void)
+{
+	u64 cycles;
+	asm volatile ("mrs %0, pmccntr_el0" : "=r" (cycles));
+	return cycles;
+}
+#else
+static inline u64 irqstat_clock(void)
+{
+	return arch_counter_read();
+}
+#endif
+
+/* Starts the calling core's cycle counter, if IRQSTAT_CYCLES wants it */
+void irqstat_init_cpu(void);
+
+void irqstat_enable(BOOL enable);
+void irqstat_reset(void);
+void irqstat_dump(void);
+
+/* `entry' is when the vector stub was entered, `dispatch' when the handler for
+ * `irq' was called and `done' when it returned. Only the `first' IRQ an
+ * exception handles gets an entry latency sample: the later ones would count
+ * the handlers that ran before them.
+ */
+void irqstat_record(unsigned irq, BOOL first, u64 entry, u64 dispatch, u64 done);
+
+/* Stub entry until irq_handler() is done, i.e. just before the eret */
+void irqstat_record_exit(u64 entry, u64 exit);
@@ -0,0 +1,38 @@
+/*
+ * kstats.h - statistics on demand, from the console
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+
+/* Control keys the UART interrupt keeps for itself instead of queueing them
+ * as input. The work is handed to a thread of its own, so the dumps can wait
+ * for the console ring instead of losing whatever doesn't fit.
+ */
+#define KSTATS_KEY_DUMP         0x14    // ^T: every subsystem's statistics
+#define KSTATS_KEY_IRQSTAT      0x10    // ^P: IRQ latency histograms on/off
+#define KSTATS_KEY_RESET        0x12    // ^R: clear the IRQ latency histograms
+
+/* Starts the thread; until then the keys are swallowed and ignored */
+void kstats_init(void);
+
+/* From the UART interrupt: TRUE if `c' was one of the keys above */
+BOOL kstats_key(char c);
+
+void kstats_dump_all(void);
@@ -30,9 +30,13 @@
 #define SYSTEM_CLOCK_FREQ	(250000000UL)
 #endif
 /* Offset applied by vmmio_read/write before accessing peripherals; drivers work with physical addresses.
- * Currently, we map all the MMIO to the top 1GiB of our level 0 PTE 256TiB address space.
+ * Currently, we map the 1GiB block containing the MMIO to the second-to-last 1GiB of our level 0 PTE
+ * 256TiB address space. On the Pi 3 the ARM-local peripherals (interrupt controller, mailboxes) sit
+ * just past it at 0x40000000, so the block after that gets the last 1GiB.
  */
-#define MMIO_VM_OFFSET          (KERN_VM_BASE | (511UL << 30))
+#define MMIO_VM_BLOCK           (MMIO_BASE & ~(GIGABYTE - 1))
+#define MMIO_VM_BASE            (KERN_VM_BASE | (510UL << 30))
+#define MMIO_VM_OFFSET          (MMIO_VM_BASE - MMIO_VM_BLOCK)
 
 // The offsets for each register.
 #define GPIO_BASE       (MMIO_BASE + 0x200000)
@@ -199,10 +203,10 @@
 
 static inline void vmmio_write32(uintptr reg, u32 data)
 {
-	*(volatile u32 *) (MMIO_VM_OFFSET | reg) = data;
+	*(volatile u32 *) (MMIO_VM_OFFSET + reg) = data;
 }
 
 static inline u32 vmmio_read32(uintptr reg)
 {
-	return *(volatile u32 *) (MMIO_VM_OFFSET | reg);
+	return *(volatile u32 *) (MMIO_VM_OFFSET + reg);
 }
\ No newline at end of file
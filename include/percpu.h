@@ -0,0 +1,88 @@
+/*
+ * percpu.h - per-core data
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+#include "util/utils.h"
+#include "util/memorymap.h"
+
+/* Variables defined with DEFINE_PER_CPU() go in .data.percpu, which is only
+ * the template: percpu_init() gives every core its own copy of the section
+ * (cache line aligned, so no two cores share a line) and points each core's
+ * TPIDR_EL1 at the distance from the template to its copy. Taking the address
+ * of a per-CPU variable therefore gets the template's, and it has to go
+ * through this_cpu_ptr() or per_cpu_ptr() to get at a real one.
+ */
+#define PER_CPU_SECTION         __attribute__((section(".data.percpu")))
+
+#define DEFINE_PER_CPU(type, name)      PER_CPU_SECTION __typeof__(type) name
+#define DECLARE_PER_CPU(type, name)     extern PER_CPU_SECTION __typeof__(type) name
+
+extern uintptr __per_cpu_offset[CORES];
+
+static inline uintptr __my_cpu_offset(void)
+{
+	uintptr off;
+	/* volatile, or the compiler could reuse it across a switch to another core */
+	asm volatile ("mrs %0, tpidr_el1" : "=r" (off));
+	return off;
+}
+
+#define __percpu_add(ptr, off)  ((__typeof__(ptr)) ((uintptr) (ptr) + (off)))
+
+#define per_cpu_ptr(ptr, cpu)   __percpu_add(ptr, __per_cpu_offset[cpu])
+#define per_cpu(var, cpu)       (*per_cpu_ptr(&(var), cpu))
+
+/* Only stable while the caller can't be moved to another core: with IRQs
+ * masked, or from IRQ context.
+ */
+#define this_cpu_ptr(ptr)       __percpu_add(ptr, __my_cpu_offset())
+
+#define __this_cpu_read(var)            (*this_cpu_ptr(&(var)))
+#define __this_cpu_write(var, val)      do { *this_cpu_ptr(&(var)) = (val); } while (0)
+#define __this_cpu_add(var, val)        do { *this_cpu_ptr(&(var)) += (val); } while (0)
+
+/* The same, safe from anywhere: IRQs are masked for the read-modify-write so
+ * that it can't be split across a preemption (and a migration). No atomics
+ * needed, no other core ever writes our copy.
+ */
+#define this_cpu_add(var, val) do {                                             \
+	u64 __daif = irq_save();                                                \
+	__this_cpu_add(var, val);                                               \
+	irq_restore(__daif);                                                    \
+} while (0)
+
+#define this_cpu_inc(var)       this_cpu_add(var, 1)
+#define this_cpu_dec(var)       this_cpu_add(var, -1)
+
+#define this_cpu_read(var) ({                                                   \
+	u64 __daif = irq_save();                                                \
+	__typeof__(var) __val = __this_cpu_read(var);                           \
+	irq_restore(__daif);                                                    \
+	__val;                                                                  \
+})
+
+/* Copies the template for every core and sets up core 0; before anything
+ * touches a per-CPU variable.
+ */
+void percpu_init(void);
+
+/* Points the calling core at its copy; first thing on a secondary */
+void percpu_init_secondary(unsigned core);
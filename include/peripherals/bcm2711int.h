@@ -30,8 +30,10 @@
 #define GIC_SPI(n)		(32 + (n))	// shared between cores
 
 // IRQs
+#define ARM_IRQLOCAL0_CNTV	GIC_PPI (11)
 #define ARM_IRQLOCAL0_CNTPNS	GIC_PPI (14)
 
+#define ARM_IRQ_ARM_MAILBOX	GIC_SPI (33)
 #define ARM_IRQ_ARM_DOORBELL_0	GIC_SPI (34)
 #define ARM_IRQ_TIMER1		GIC_SPI (65)
 #define ARM_IRQ_DMA0		GIC_SPI (80)
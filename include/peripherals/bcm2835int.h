@@ -46,72 +46,72 @@
 #define ARM_IRQBASIC_BASE	(ARM_IRQ2_BASE + ARM_IRQS_PER_REG)
 #define ARM_IRQLOCAL_BASE	(ARM_IRQBASIC_BASE + ARM_IRQS_BASIC_REG)
 
-#define ARM_IRQ_TIMER0		(1 << 0U)
-#define ARM_IRQ_TIMER1		(1 << 1U)
-#define ARM_IRQ_TIMER2		(1 << 2U)
-#define ARM_IRQ_TIMER3		(1 << 3U)
-#define ARM_IRQ_CODEC0		(1 << 4U)
-#define ARM_IRQ_CODEC1		(1 << 5U)
-#define ARM_IRQ_CODEC2		(1 << 6U)
-#define ARM_IRQ_JPEG		(1 << 7U)
-#define ARM_IRQ_ISP		(1 << 8U)
-#define ARM_IRQ_USB		(1 << 9U)
-#define ARM_IRQ_3D		(1 << 10U)
-#define ARM_IRQ_TRANSPOSER	(1 << 11U)
-#define ARM_IRQ_MULTICORESYNC0	(1 << 12U)
-#define ARM_IRQ_MULTICORESYNC1	(1 << 13U)
-#define ARM_IRQ_MULTICORESYNC2	(1 << 14U)
-#define ARM_IRQ_MULTICORESYNC3	(1 << 15U)
-#define ARM_IRQ_DMA0		(1 << 16U)
-#define ARM_IRQ_DMA1		(1 << 17U)
-#define ARM_IRQ_DMA2		(1 << 18U)
-#define ARM_IRQ_DMA3		(1 << 19U)
-#define ARM_IRQ_DMA4		(1 << 20U)
-#define ARM_IRQ_DMA5		(1 << 21U)
-#define ARM_IRQ_DMA6		(1 << 22U)
-#define ARM_IRQ_DMA7		(1 << 23U)
-#define ARM_IRQ_DMA8		(1 << 24U)
-#define ARM_IRQ_DMA9		(1 << 25U)
-#define ARM_IRQ_DMA10		(1 << 26U)
-#define ARM_IRQ_DMA11		(1 << 27U)
-#define ARM_IRQ_DMA_SHARED	(1 << 28U)
-#define ARM_IRQ_AUX		(1 << 29U)
-#define ARM_IRQ_ARM		(1 << 30U)
-#define ARM_IRQ_VPUDMA		(1 << 31U)
+#define ARM_IRQ_TIMER0		(ARM_IRQ1_BASE + 0)
+#define ARM_IRQ_TIMER1		(ARM_IRQ1_BASE + 1)
+#define ARM_IRQ_TIMER2		(ARM_IRQ1_BASE + 2)
+#define ARM_IRQ_TIMER3		(ARM_IRQ1_BASE + 3)
+#define ARM_IRQ_CODEC0		(ARM_IRQ1_BASE + 4)
+#define ARM_IRQ_CODEC1		(ARM_IRQ1_BASE + 5)
+#define ARM_IRQ_CODEC2		(ARM_IRQ1_BASE + 6)
+#define ARM_IRQ_JPEG		(ARM_IRQ1_BASE + 7)
+#define ARM_IRQ_ISP		(ARM_IRQ1_BASE + 8)
+#define ARM_IRQ_USB		(ARM_IRQ1_BASE + 9)
+#define ARM_IRQ_3D		(ARM_IRQ1_BASE + 10)
+#define ARM_IRQ_TRANSPOSER	(ARM_IRQ1_BASE + 11)
+#define ARM_IRQ_MULTICORESYNC0	(ARM_IRQ1_BASE + 12)
+#define ARM_IRQ_MULTICORESYNC1	(ARM_IRQ1_BASE + 13)
+#define ARM_IRQ_MULTICORESYNC2	(ARM_IRQ1_BASE + 14)
+#define ARM_IRQ_MULTICORESYNC3	(ARM_IRQ1_BASE + 15)
+#define ARM_IRQ_DMA0		(ARM_IRQ1_BASE + 16)
+#define ARM_IRQ_DMA1		(ARM_IRQ1_BASE + 17)
+#define ARM_IRQ_DMA2		(ARM_IRQ1_BASE + 18)
+#define ARM_IRQ_DMA3		(ARM_IRQ1_BASE + 19)
+#define ARM_IRQ_DMA4		(ARM_IRQ1_BASE + 20)
+#define ARM_IRQ_DMA5		(ARM_IRQ1_BASE + 21)
+#define ARM_IRQ_DMA6		(ARM_IRQ1_BASE + 22)
+#define ARM_IRQ_DMA7		(ARM_IRQ1_BASE + 23)
+#define ARM_IRQ_DMA8		(ARM_IRQ1_BASE + 24)
+#define ARM_IRQ_DMA9		(ARM_IRQ1_BASE + 25)
+#define ARM_IRQ_DMA10		(ARM_IRQ1_BASE + 26)
+#define ARM_IRQ_DMA11		(ARM_IRQ1_BASE + 27)
+#define ARM_IRQ_DMA_SHARED	(ARM_IRQ1_BASE + 28)
+#define ARM_IRQ_AUX		(ARM_IRQ1_BASE + 29)
+#define ARM_IRQ_ARM		(ARM_IRQ1_BASE + 30)
+#define ARM_IRQ_VPUDMA		(ARM_IRQ1_BASE + 31)
 
 #define ARM_IRQ2_BASE		(ARM_IRQ1_BASE + ARM_IRQS_PER_REG)
-#define ARM_IRQ_HOSTPORT	(1 << 0U)
-#define ARM_IRQ_VIDEOSCALER	(1 << 1U)
-#define ARM_IRQ_CCP2TX		(1 << 2U)
-#define ARM_IRQ_SDC		(1 << 3U)
-#define ARM_IRQ_DSI0		(1 << 4U)
-#define ARM_IRQ_AVE		(1 << 5U)
-#define ARM_IRQ_CAM0		(1 << 6U)
-#define ARM_IRQ_CAM1		(1 << 7U)
-#define ARM_IRQ_HDMI0		(1 << 8U)
-#define ARM_IRQ_HDMI1		(1 << 9U)
-#define ARM_IRQ_PIXELVALVE1	(1 << 10U)
-#define ARM_IRQ_I2CSPISLV	(1 << 11U)
-#define ARM_IRQ_DSI1		(1 << 12U)
-#define ARM_IRQ_PWA0		(1 << 13U)
-#define ARM_IRQ_PWA1		(1 << 14U)
-#define ARM_IRQ_CPR		(1 << 15U)
-#define ARM_IRQ_SMI		(1 << 16U)
-#define ARM_IRQ_GPIO0		(1 << 17U)
-#define ARM_IRQ_GPIO1		(1 << 18U)
-#define ARM_IRQ_GPIO2		(1 << 19U)
-#define ARM_IRQ_GPIO3		(1 << 20U)
-#define ARM_IRQ_I2C		(1 << 21U)
-#define ARM_IRQ_SPI		(1 << 22U)
-#define ARM_IRQ_I2SPCM		(1 << 23U)
-#define ARM_IRQ_SDIO		(1 << 24U)
-#define ARM_IRQ_UART		(1 << 25U)
-#define ARM_IRQ_SLIMBUS		(1 << 26U)
-#define ARM_IRQ_VEC		(1 << 27U)
-#define ARM_IRQ_CPG		(1 << 28U)
-#define ARM_IRQ_RNG		(1 << 29U)
-#define ARM_IRQ_ARASANSDIO	(1 << 30U)
-#define ARM_IRQ_AVSPMON		(1 << 31U)
+#define ARM_IRQ_HOSTPORT	(ARM_IRQ2_BASE + 0)
+#define ARM_IRQ_VIDEOSCALER	(ARM_IRQ2_BASE + 1)
+#define ARM_IRQ_CCP2TX		(ARM_IRQ2_BASE + 2)
+#define ARM_IRQ_SDC		(ARM_IRQ2_BASE + 3)
+#define ARM_IRQ_DSI0		(ARM_IRQ2_BASE + 4)
+#define ARM_IRQ_AVE		(ARM_IRQ2_BASE + 5)
+#define ARM_IRQ_CAM0		(ARM_IRQ2_BASE + 6)
+#define ARM_IRQ_CAM1		(ARM_IRQ2_BASE + 7)
+#define ARM_IRQ_HDMI0		(ARM_IRQ2_BASE + 8)
+#define ARM_IRQ_HDMI1		(ARM_IRQ2_BASE + 9)
+#define ARM_IRQ_PIXELVALVE1	(ARM_IRQ2_BASE + 10)
+#define ARM_IRQ_I2CSPISLV	(ARM_IRQ2_BASE + 11)
+#define ARM_IRQ_DSI1		(ARM_IRQ2_BASE + 12)
+#define ARM_IRQ_PWA0		(ARM_IRQ2_BASE + 13)
+#define ARM_IRQ_PWA1		(ARM_IRQ2_BASE + 14)
+#define ARM_IRQ_CPR		(ARM_IRQ2_BASE + 15)
+#define ARM_IRQ_SMI		(ARM_IRQ2_BASE + 16)
+#define ARM_IRQ_GPIO0		(ARM_IRQ2_BASE + 17)
+#define ARM_IRQ_GPIO1		(ARM_IRQ2_BASE + 18)
+#define ARM_IRQ_GPIO2		(ARM_IRQ2_BASE + 19)
+#define ARM_IRQ_GPIO3		(ARM_IRQ2_BASE + 20)
+#define ARM_IRQ_I2C		(ARM_IRQ2_BASE + 21)
+#define ARM_IRQ_SPI		(ARM_IRQ2_BASE + 22)
+#define ARM_IRQ_I2SPCM		(ARM_IRQ2_BASE + 23)
+#define ARM_IRQ_SDIO		(ARM_IRQ2_BASE + 24)
+#define ARM_IRQ_UART		(ARM_IRQ2_BASE + 25)
+#define ARM_IRQ_SLIMBUS		(ARM_IRQ2_BASE + 26)
+#define ARM_IRQ_VEC		(ARM_IRQ2_BASE + 27)
+#define ARM_IRQ_CPG		(ARM_IRQ2_BASE + 28)
+#define ARM_IRQ_RNG		(ARM_IRQ2_BASE + 29)
+#define ARM_IRQ_ARASANSDIO	(ARM_IRQ2_BASE + 30)
+#define ARM_IRQ_AVSPMON		(ARM_IRQ2_BASE + 31)
 
 #define ARM_IRQ_ARM_TIMER	(ARM_IRQBASIC_BASE + 0)
 #define ARM_IRQ_ARM_MAILBOX	(ARM_IRQBASIC_BASE + 1)
@@ -139,6 +139,21 @@
 
 #define IRQ_LINES		(ARM_IRQS_PER_REG * 2 + ARM_IRQS_BASIC_REG + ARM_IRQS_LOCAL_REG)
 
+// bit for an IRQ number within its pending/enable/disable register
+#define ARM_IRQ_MASK(irq)	(1U << ((irq) % ARM_IRQS_PER_REG))
+
+// IRQ basic pending register bits
+#define ARM_IC_BASIC_PENDING_1		(1U << 8)	// something in IRQ pending 1
+#define ARM_IC_BASIC_PENDING_2		(1U << 9)	// something in IRQ pending 2
+/* GPU IRQs 7, 9, 10, 18, 19 and 53-57, 62 are "shortcut" straight into bits 10-20
+ * of the basic pending register, and do NOT set bit 8/9 above
+ */
+#define ARM_IC_BASIC_SHORTCUT_1		(0x1FU << 10)
+#define ARM_IC_BASIC_SHORTCUT_2		(0x3FU << 15)
+
+// core-local IRQ pending register bit for the cascaded GPU interrupts
+#define ARM_LOCAL_PENDING_GPU		(1U << (ARM_IRQLOCAL0_GPU - ARM_IRQLOCAL_BASE))
+
 // FIQs
 #define ARM_FIQ_TIMER0		0
 #define ARM_FIQ_TIMER1		1
@@ -215,4 +230,7 @@
 
 #define ARM_MAX_FIQ		71
 
+// ARM_IC_FIQ_CONTROL: enable bit, source (ARM_FIQ_*) in bits 0-6
+#define ARM_IC_FIQ_ENABLE	0x80
+
 #endif
@@ -0,0 +1,77 @@
+/*
+ * gic400.h - ARM GIC-400 (GICv2) register definitions
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#if RASPPI >= 4
+
+#include "peripherals/bcm2711.h"
+
+//
+// Distributor
+//
+#define GICD_CTLR		(ARM_GICD_BASE + 0x000)
+	#define GICD_CTLR_ENABLE	(1 << 0)
+#define GICD_TYPER		(ARM_GICD_BASE + 0x004)
+	#define GICD_TYPER_ITLINES(typer)	((((typer) & 0x1F) + 1) * 32)
+#define GICD_IGROUPR0		(ARM_GICD_BASE + 0x080)
+#define GICD_ISENABLER0		(ARM_GICD_BASE + 0x100)
+#define GICD_ICENABLER0		(ARM_GICD_BASE + 0x180)
+#define GICD_ISPENDR0		(ARM_GICD_BASE + 0x200)
+#define GICD_ICPENDR0		(ARM_GICD_BASE + 0x280)
+#define GICD_ISACTIVER0		(ARM_GICD_BASE + 0x300)
+#define GICD_ICACTIVER0		(ARM_GICD_BASE + 0x380)
+#define GICD_IPRIORITYR0	(ARM_GICD_BASE + 0x400)
+#define GICD_ITARGETSR0		(ARM_GICD_BASE + 0x800)
+#define GICD_ICFGR0		(ARM_GICD_BASE + 0xC00)
+#define GICD_SGIR		(ARM_GICD_BASE + 0xF00)
+	#define GICD_SGIR_TARGETS(mask)		(((mask) & 0xFF) << 16)
+	#define GICD_SGIR_SGIINTID(sgi)		((sgi) & 0xF)
+
+//
+// CPU interface
+//
+#define GICC_CTLR		(ARM_GICC_BASE + 0x000)
+	#define GICC_CTLR_ENABLE	(1 << 0)
+#define GICC_PMR		(ARM_GICC_BASE + 0x004)
+#define GICC_BPR		(ARM_GICC_BASE + 0x008)
+#define GICC_IAR		(ARM_GICC_BASE + 0x00C)
+	#define GICC_IAR_INTID(iar)	((iar) & 0x3FF)
+	#define GICC_IAR_CPUID(iar)	(((iar) >> 10) & 0x7)
+#define GICC_EOIR		(ARM_GICC_BASE + 0x010)
+#define GICC_RPR		(ARM_GICC_BASE + 0x014)
+#define GICC_HPPIR		(ARM_GICC_BASE + 0x018)
+
+#define GIC_SGIS		16
+#define GIC_PPIS		16
+#define GIC_SPI_BASE		(GIC_SGIS + GIC_PPIS)
+#define GIC_INTID_SPURIOUS	1023
+
+/* The BCM2711 GIC-400 implements 16 priority levels, in the top nibble */
+#define GIC_PRIO_SHIFT		4
+#define GIC_PRIO_DEFAULT	0xA0
+/* The PMR only lets through priorities strictly above (below, numerically) its
+ * own value, and with 16 levels 0xFF reads back as 0xF0: a line at 0xF0 would
+ * never be signalled. So 0xE0 is the lowest usable priority.
+ */
+#define GIC_PRIO_MASK_NONE	0xFF
+#define GIC_PRIO_LOWEST		0xE0
+
+#endif
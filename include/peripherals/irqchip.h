@@ -0,0 +1,96 @@
+/*
+ * irqchip.h - interface shared by the interrupt controller drivers
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+
+/* Exactly one of these gets built, depending on RASPPI:
+ *      RASPPI <= 3: BCM2835 ("legacy") controller cascaded into the
+ *                   BCM2836 core-local controller (bcm2836_irq.c)
+ *      RASPPI == 4: GIC-400 (gic400.c)
+ *
+ * IRQ numbers are the ARM_IRQ_* values from bcm2835int.h/bcm2711int.h.
+ * Priorities follow the GIC convention: 0 is the most urgent.
+ */
+
+/* irqchip_ack() hands back the interrupt ID in the low bits of an opaque value that
+ * has to be passed back to irqchip_eoi() as-is (the GIC wants the whole IAR value).
+ */
+#define IRQCHIP_IRQ(ack)        ((ack) & 0x3FF)
+#define IRQ_SPURIOUS            1023
+
+/* Masks every line and sets up the controller and this core's interface to it */
+void irqchip_init(void);
+
+/* Sets up the calling core's interface to the controller (core 0 is done by irqchip_init()) */
+void irqchip_init_secondary(void);
+
+void irqchip_unmask(unsigned irq);
+void irqchip_mask(unsigned irq);
+
+/* Acknowledges the most urgent pending interrupt, or returns IRQ_SPURIOUS
+ * if there's nothing (left) to handle.
+ */
+u32  irqchip_ack(void);
+void irqchip_eoi(u32 ack);
+
+/* Only the top IRQ_PRIO_SHIFT bits of a priority count (that's all the GIC-400
+ * implements), giving IRQ_PRIO_CLASSES classes. An interrupt can only preempt the
+ * handler of one in a strictly less urgent class; class 0 handlers always run
+ * with IRQs masked.
+ */
+#define IRQ_PRIO_SHIFT          4
+#define IRQ_PRIO_CLASSES        (256 >> IRQ_PRIO_SHIFT)
+#define IRQ_PRIO_CLASS(prio)    ((prio) >> IRQ_PRIO_SHIFT)
+#define IRQ_PRIO_HIGHEST        0x00
+#define IRQ_PRIO_DEFAULT        0xA0
+#define IRQ_PRIO_LOWEST         0xE0    // see GIC_PRIO_LOWEST; irq_set_priority() clamps to it
+
+/* While the handler for an acknowledged interrupt runs, the controller only
+ * signals interrupts of a more urgent class, until the matching irqchip_eoi().
+ */
+void irqchip_set_priority(unsigned irq, u8 prio);
+
+/* Delivers `irq' to this core as FIQ instead of IRQ; returns -1 if the controller
+ * can't. Only one line can be routed to FIQ at a time.
+ */
+int  irqchip_route_fiq(unsigned irq);
+void irqchip_unroute_fiq(unsigned irq);
+
+/* Routes a shared interrupt to the cores in `cpumask' (bit n = core n) */
+void irqchip_set_affinity(unsigned irq, unsigned cpumask);
+
+/* Raises software-generated interrupt `sgi' (0-15) on the cores in `cpumask' */
+void irqchip_send_sgi(unsigned sgi, unsigned cpumask);
+
+/* For the SGI handler, before it looks at why it was sent: lets the next
+ * irqchip_send_sgi() to this core raise the interrupt again. On the GIC
+ * acknowledging does that, so it's a no-op there.
+ */
+void irqchip_clear_sgis(void);
+
+/* The IRQ number an SGI arrives as: one mailbox for all of them on the
+ * BCM2836, its own ID on the GIC
+ */
+#if RASPPI <= 3
+#define IRQ_SGI(sgi)            ARM_IRQLOCAL0_MAILBOX0
+#else
+#define IRQ_SGI(sgi)            (sgi)
+#endif
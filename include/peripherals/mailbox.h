@@ -0,0 +1,98 @@
+/*
+ * mailbox.h - VideoCore firmware property interface
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+
+/* Property tags; see the firmware wiki's "Mailbox property interface" page.
+ * Temperatures are in thousandths of a degree C, clock rates in Hz.
+ */
+#define MBOX_TAG_GET_FIRMWARE_REVISION  0x00000001
+#define MBOX_TAG_GET_BOARD_MODEL        0x00010001
+#define MBOX_TAG_GET_BOARD_REVISION     0x00010002
+#define MBOX_TAG_GET_BOARD_MAC          0x00010003
+#define MBOX_TAG_GET_BOARD_SERIAL       0x00010004
+#define MBOX_TAG_GET_ARM_MEMORY         0x00010005
+#define MBOX_TAG_GET_VC_MEMORY          0x00010006
+#define MBOX_TAG_GET_CLOCK_RATE         0x00030002
+#define MBOX_TAG_GET_MAX_CLOCK_RATE     0x00030004
+#define MBOX_TAG_GET_MIN_CLOCK_RATE     0x00030007
+#define MBOX_TAG_SET_CLOCK_RATE         0x00038002
+#define MBOX_TAG_GET_TEMPERATURE        0x00030006
+#define MBOX_TAG_GET_MAX_TEMPERATURE    0x0003000A
+
+#define MBOX_CLOCK_ARM                  3
+#define MBOX_CLOCK_CORE                 4
+
+/* How long to wait for the firmware before giving up on it */
+#define MBOX_TIMEOUT_US                 100000
+
+#define MBOX_MSG_WORDS                  128
+#define MBOX_MSG_ALIGN                  64      // a cache line
+
+/* One property message, holding any number of tags that fit; the firmware
+ * answers them all in one round trip. `buf' is the message itself. The
+ * firmware never sees it directly: mbox_msg_send() copies it through the
+ * mailbox's own buffer, so an mbox_msg can live anywhere (stack included).
+ *
+ *      struct mbox_msg m;
+ *      mbox_msg_init(&m);
+ *      int rev = mbox_msg_add(&m, MBOX_TAG_GET_BOARD_REVISION, NULL, 0, 1);
+ *      int mem = mbox_msg_add(&m, MBOX_TAG_GET_ARM_MEMORY, NULL, 0, 2);
+ *      if (mbox_msg_send(&m) == 0 && (v = mbox_msg_value(&m, rev, NULL)))
+ *              ...
+ */
+struct mbox_msg {
+	u32 buf[MBOX_MSG_WORDS];
+	unsigned len;           // words used, up to (not including) the end tag
+	BOOL overflow;          // a tag didn't fit; mbox_msg_send() will refuse
+};
+
+void mbox_msg_init(struct mbox_msg *m);
+
+/* Appends a tag with `nreq' words of request (NULL for none) and room for
+ * `nresp' words of response. Returns a handle for mbox_msg_value(), or -1
+ * if the message is full.
+ */
+int mbox_msg_add(struct mbox_msg *m, u32 tag, const u32 *req, unsigned nreq, unsigned nresp);
+
+/* Sends the message and waits for the reply: sleeping in WFE until the
+ * mailbox IRQ says it's in, or polling where that can't be used (before
+ * mbox_init(), in IRQ context, with IRQs masked), for up to
+ * MBOX_TIMEOUT_US. Returns 0 if the firmware processed the message, -1
+ * otherwise. After a timeout, every send fails until the firmware's late
+ * reply to the timed-out message has come in. Not from IRQ context while
+ * a thread might be mid-call.
+ */
+int mbox_msg_send(struct mbox_msg *m);
+
+/* The response words of the tag added as `handle', or NULL if the firmware
+ * didn't answer it; `nbytes', if given, gets the response length.
+ */
+const u32 *mbox_msg_value(const struct mbox_msg *m, int handle, unsigned *nbytes);
+
+/* A single tag whose request and response are both `nval' words (the
+ * caller's `val'); the reply overwrites `val'. Returns 0 or -1.
+ */
+int mbox_property_tag(u32 tag, u32 *val, unsigned nval);
+
+/* Takes replies by IRQ from here on */
+void mbox_init(void);
+void mbox_stats_dump(void);
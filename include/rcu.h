@@ -0,0 +1,102 @@
+/*
+ * rcu.h - read-copy-update
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+#include "atomic.h"
+#include "percpu.h"
+#include "sched.h"
+
+/* Quiescent-state based RCU for data that is read all the time and written
+ * almost never. A writer publishes a new version with rcu_assign_pointer()
+ * and frees the old one once every reader that could still see it is done:
+ * synchronize_rcu() waits for that, call_rcu() has it done later.
+ *
+ * A grace period is over once every online core has passed through a
+ * quiescent state, which is any of:
+ *      - a context switch
+ *      - a pass through the idle loop
+ *      - the end of the outermost IRQ handler, if the thread it interrupted
+ *        isn't inside rcu_read_lock()
+ * Starting one kicks every core with a reschedule IPI so that nobody holds
+ * it up for long.
+ *
+ * IRQ handlers and softirqs are read-side critical sections as they are,
+ * since nothing switches until they have finished; they need no
+ * rcu_read_lock(). In a thread, rcu_read_lock() just counts: preemption is
+ * held off until the matching rcu_read_unlock() rather than prevented, so
+ * neither costs an atomic or an IRQ mask. A reader must not block, yield or
+ * sleep.
+ */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func) (struct rcu_head *head);
+};
+
+#define rcu_dereference(p)              READ_ONCE(p)
+#define rcu_assign_pointer(p, v)        smp_store_release(&(p), v)
+
+/* For NULL, or anything readers can't get at yet: no ordering needed */
+#define RCU_INIT_POINTER(p, v)          WRITE_ONCE(p, v)
+
+void rcu_read_unlock_special(void);
+
+static inline void rcu_read_lock(void)
+{
+	thread_current()->rcu_nesting++;
+	barrier();
+}
+
+static inline void rcu_read_unlock(void)
+{
+	struct thread *t = thread_current();
+
+	barrier();
+	if (--t->rcu_nesting == 0 && __builtin_expect(t->rcu_resched, 0))
+		rcu_read_unlock_special();
+}
+
+static inline BOOL rcu_read_lock_held(void)
+{
+	return thread_current()->rcu_nesting != 0;
+}
+
+/* Returns once every reader that started before the call has finished. From
+ * a thread with IRQs unmasked, outside any read-side section; after sched_init().
+ */
+void synchronize_rcu(void);
+
+/* Calls func(head) from a softirq once a grace period has gone by. Any context. */
+void call_rcu(struct rcu_head *head, void (*func) (struct rcu_head *head));
+
+/* Set for the cores the current grace period is still waiting on */
+DECLARE_PER_CPU(volatile BOOL, rcu_qs_wanted);
+
+void rcu_report_qs(void);
+
+/* For the scheduler: IRQs masked, nothing on this core inside a read-side section */
+static inline void rcu_note_qs(void)
+{
+	if (__builtin_expect(__this_cpu_read(rcu_qs_wanted), 0))
+		rcu_report_qs();
+}
+
+void rcu_init(void);
+void rcu_stats_dump(void);
@@ -0,0 +1,134 @@
+/*
+ * sched.h - preemptive kernel threads
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+#include "exceptions.h"
+#include "hrtimer.h"
+
+/* including one idle thread per core */
+#define SCHED_MAX_THREADS       16
+#define THREAD_STACK_SIZE       (16 * 1024)
+
+/* 0 is the most urgent; the idle threads sit alone at SCHED_PRIO_IDLE */
+#define SCHED_PRIOS             32
+#define SCHED_PRIO_DEFAULT      16
+#define SCHED_PRIO_IDLE         (SCHED_PRIOS - 1)
+
+/* Threads sharing the top priority take turns every this often */
+#define SCHED_TIMESLICE_NS      (10 * NSEC_PER_MSEC)
+
+/* A thread that last ran less than this long ago is assumed to still have its
+ * working set in its old core's L1, and is only stolen from there if that core
+ * has nothing else to hand over.
+ */
+#define SCHED_MIGRATION_COST_NS (500 * NSEC_PER_USEC)
+
+enum thread_state {
+	THREAD_FREE,
+	THREAD_RUNNABLE,        // on the run queue
+	THREAD_RUNNING,
+	THREAD_BLOCKED,
+	THREAD_DEAD,            // waiting to be switched away from for the last time
+};
+
+/* Threads run at EL1t on their own stack (sp_el0). A thread that isn't running
+ * has its complete register state in `ctx', in the same layout the exception
+ * stubs use, so switching is a matter of swapping frames on the way out of an
+ * IRQ (preemption) or an SVC (everything else).
+ *
+ * Each core has its own run queue; a thread stays on the core it last ran on
+ * (`cpu') until an idle core steals it. `state', `next' and `cpu' belong to
+ * the lock of run queue `cpu'.
+ */
+struct thread {
+	struct ExceptionFrame ctx;
+	struct thread *next;    // run queue
+	enum thread_state state;
+	unsigned prio;
+	unsigned cpu;           // whose run queue it's on, or last ran on
+	volatile BOOL on_cpu;   // `ctx' isn't valid until this goes FALSE
+	const char *name;
+	BOOL wake_pending;      // thread_wake() came before thread_block()
+	struct hrtimer sleep_timer;
+	u64 switches;           // times switched in
+	u64 migrations;         // times moved to another core
+	u64 runtime;            // counter ticks spent running
+	u64 last_run;
+	u64 switched_out;       // counter value when it last came off a CPU
+	unsigned rcu_nesting;   // rcu_read_lock() depth; only the thread itself changes it
+	BOOL rcu_resched;       // a preemption was held off until rcu_read_unlock()
+};
+
+/* Turns the calling (boot) context into core 0's idle thread */
+void sched_init(void);
+
+/* Same for a secondary core, after sched_init() */
+void sched_init_secondary(void);
+
+/* Never returns; what's left of kernel_main() (or secondary_main()) after
+ * start-up. Looks for work to steal every time the core wakes up.
+ */
+_Noreturn void sched_idle(void);
+
+/* Returns NULL if all SCHED_MAX_THREADS slots are in use. The thread starts
+ * out on the least loaded core.
+ */
+struct thread *thread_create(const char *name, void (*fn) (void *), void *arg, unsigned prio);
+
+/* TPIDR_EL0 always holds the thread running on the core, so unlike most
+ * per-core state this needs no IRQ masking: a thread reads itself wherever it
+ * runs. NULL on a core that hasn't been through sched_init*() yet.
+ */
+static inline struct thread *thread_current(void)
+{
+	struct thread *t;
+	asm ("mrs %0, tpidr_el0" : "=r" (t));
+	return t;
+}
+
+void thread_yield(void);
+_Noreturn void thread_exit(void);
+
+/* Takes the current thread off the CPU until thread_wake(); a wake-up that
+ * comes in first (e.g. from an IRQ) makes the next thread_block() return
+ * straight away.
+ */
+void thread_block(void);
+void thread_wake(struct thread *t);
+/* At least `ns'; other wake-ups in the meantime don't cut it short */
+void thread_sleep_ns(u64 ns);
+
+/* Called by the SVC and IRQ stubs with the full frame of the current thread */
+void sched_switch(struct ExceptionFrame *frame);
+
+/* Counter ticks core `cpu' has spent asleep in the idle loop, the current
+ * nap included; for load sampling
+ */
+u64 sched_idle_ticks(unsigned cpu);
+
+void sched_stats_dump(void);
+
+#ifdef SCHED_BENCH
+/* Runs the same CPU-bound work on one thread and then on several, from the
+ * idle thread, and reports the speed-up along with the run queue statistics.
+ */
+void sched_bench(void);
+#endif
@@ -0,0 +1,41 @@
+/*
+ * smp.h - secondary core bring-up
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+#include "util/memorymap.h"
+
+static inline unsigned smp_processor_id(void)
+{
+	u64 mpidr;
+	asm volatile ("mrs %0, mpidr_el1" : "=r" (mpidr));
+	return mpidr & (CORES - 1);
+}
+
+/* bit n set once core n has made it to secondary_main() (core 0 from the start) */
+extern volatile u32 cpu_online_mask;
+
+/* Releases cores 1..CORES-1 from the firmware's spin table and waits (a bounded
+ * time) for each to come up. Returns the number of cores online.
+ */
+unsigned smp_boot_secondaries(void);
+
+/* Where _start_secondary (boot.S) ends up, on the core's own stacks, at EL1 */
+_Noreturn void secondary_main(unsigned core);
@@ -0,0 +1,82 @@
+/*
+ * softirq.h - deferred interrupt work
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+
+/* Work that hard IRQ handlers push out of interrupt context. Pending softirqs
+ * are run by irq_handler() once the controller has been drained, with IRQs
+ * unmasked again, so they can be interrupted but never run concurrently with
+ * themselves. Lower numbers run first.
+ */
+enum softirq_nr {
+	SOFTIRQ_HI,             // high-priority tasklets
+	SOFTIRQ_TIMER,
+	SOFTIRQ_TASKLET,
+	SOFTIRQ_RCU,            // call_rcu() callbacks
+	NR_SOFTIRQS,
+};
+
+typedef void (*softirq_action_t) (void);
+
+struct softirq_stats {
+	u64 raised;             // raise_softirq() calls, including already pending
+	u64 runs;               // times the action was called
+	u64 max_ticks;          // longest single run, in counter ticks
+};
+
+void open_softirq(unsigned nr, softirq_action_t action);
+
+/* May be called from any context. Outside of an IRQ the calling core kicks
+ * itself with an IPI, so that the softirq runs on the way out of that rather
+ * than whenever the next interrupt happens to come (which, tickless, could be
+ * never).
+ */
+void raise_softirq(unsigned nr);
+
+/* Called by irq_handler() with IRQs masked; returns with IRQs masked. */
+void do_softirq(void);
+
+/* TRUE while do_softirq() is running, i.e. in an IRQ that interrupted it */
+BOOL in_softirq(void);
+
+/* Tasklets are one-shot callbacks queued on SOFTIRQ_TASKLET/SOFTIRQ_HI. Scheduling one
+ * that is already queued is a no-op, so a burst of interrupts collapses into a
+ * single call; a tasklet may reschedule itself from its own callback. A tasklet
+ * never runs on two cores at once: if it gets scheduled on another core while
+ * its callback is running, that core holds on to it until the callback is done.
+ */
+#define TASKLET_STATE_SCHED     BIT(0)  // queued, on some core
+#define TASKLET_STATE_RUN       BIT(1)  // callback running, on some core
+
+struct tasklet {
+	struct tasklet *next;
+	void (*func) (unsigned long);
+	unsigned long data;
+	volatile u32 state;
+};
+
+#define TASKLET_INIT(f, d)      { .next = NULL, .func = (f), .data = (d), .state = 0 }
+
+void tasklet_schedule(struct tasklet *t);
+void tasklet_hi_schedule(struct tasklet *t);
+
+void softirq_init(void);
+void softirq_stats_dump(void);
@@ -0,0 +1,264 @@
+/*
+ * spinlock.h - SMP spinlocks
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+#include "atomic.h"
+#include "util/utils.h"
+#ifdef LOCKSTAT
+#include "arch_timer.h"
+#endif
+
+/* Two kinds of lock, both FIFO-fair:
+ *
+ * spinlock_t is a ticket lock: one word, and the right choice for anything
+ * that's only ever taken by a couple of cores at a time. All waiters watch
+ * the same word, so every release is a cache line transfer to each of them.
+ *
+ * mcs_lock_t is a queue of per-waiter nodes, each waiter watching its own,
+ * so a release only disturbs the next in line. For locks all cores hammer.
+ *
+ * Neither masks IRQs by itself: a lock that's also taken from IRQ context has
+ * to be taken with the _irqsave variants everywhere else. Waiters sit in WFE
+ * with the lock word in their exclusive monitor, so the releasing store wakes
+ * them up without a SEV.
+ *
+ * Building with LOCKSTAT keeps per-lock counts of acquisitions and contended
+ * acquisitions, plus wait and hold times; see lockstat_dump().
+ */
+
+#ifdef LOCKSTAT
+struct lock_stat {
+	const char *name;       // the expression it was first taken through
+	struct lock_stat *next; // on the lockstat list, once taken
+	u64 acquisitions;
+	u64 contentions;
+	u64 wait_ticks;
+	u64 max_wait;
+	u64 hold_ticks;
+	u64 max_hold;
+	u64 acquired_at;
+};
+
+/* Both called with the lock held */
+void lockstat_acquired(struct lock_stat *s, const char *name, u64 start, BOOL contended);
+void lockstat_release(struct lock_stat *s);
+
+void lockstat_dump(void);
+void lockstat_reset(void);
+
+#define LOCKSTAT_FIELD          struct lock_stat stat;
+#define lockstat_start()        arch_counter_read()
+#else
+#define LOCKSTAT_FIELD
+#define lockstat_start()        0
+#define lockstat_acquired(s, name, start, contended) ((void) (name), (void) (start), (void) (contended))
+#define lockstat_release(s)     ((void) 0)
+#endif
+
+/* Each waits in WFE until the value at `p' differs from `val', with acquire
+ * semantics on the load that sees it change, and returns that value.
+ */
+static inline u32 __wfe_wait_ne16(const volatile u16 *p, u16 val)
+{
+	u32 v;
+	asm volatile ("	sevl\n"
+		      "1:	wfe\n"
+		      "	ldaxrh	%w0, %1\n"
+		      "	cmp	%w0, %w2\n"
+		      "	b.eq	1b"
+		      : "=&r" (v) : "Q" (*p), "r" ((u32) val) : "memory", "cc");
+	return v;
+}
+
+static inline u32 __wfe_wait_ne32(const volatile u32 *p, u32 val)
+{
+	u32 v;
+	asm volatile ("	sevl\n"
+		      "1:	wfe\n"
+		      "	ldaxr	%w0, %1\n"
+		      "	cmp	%w0, %w2\n"
+		      "	b.eq	1b"
+		      : "=&r" (v) : "Q" (*p), "r" (val) : "memory", "cc");
+	return v;
+}
+
+static inline u64 __wfe_wait_ne64(const volatile u64 *p, u64 val)
+{
+	u64 v;
+	asm volatile ("	sevl\n"
+		      "1:	wfe\n"
+		      "	ldaxr	%0, %1\n"
+		      "	cmp	%0, %2\n"
+		      "	b.eq	1b"
+		      : "=&r" (v) : "Q" (*p), "r" (val) : "memory", "cc");
+	return v;
+}
+
+/* Ticket lock. `next' is the ticket the next locker draws, `owner' the one
+ * being served; little-endian, so `next' is the top half of `val'.
+ */
+typedef struct {
+	union {
+		volatile u32 val;
+		struct {
+			volatile u16 owner;
+			volatile u16 next;
+		};
+	};
+	LOCKSTAT_FIELD
+} spinlock_t;
+
+#define TICKET_SHIFT            16
+#define SPINLOCK_INIT           { .val = 0 }
+
+static inline void spin_lock_init(spinlock_t *lock)
+{
+	*lock = (spinlock_t) SPINLOCK_INIT;
+}
+
+static inline void __spin_lock(spinlock_t *lock, const char *name)
+{
+	u64 start = lockstat_start();
+	u32 old = atomic_fetch_add(&lock->val, 1U << TICKET_SHIFT);
+	u16 ticket = old >> TICKET_SHIFT;
+	u16 owner = old;
+	BOOL contended = owner != ticket;
+
+	while (owner != ticket)
+		owner = __wfe_wait_ne16(&lock->owner, owner);
+
+	lockstat_acquired(&lock->stat, name, start, contended);
+}
+
+static inline BOOL __spin_trylock(spinlock_t *lock, const char *name)
+{
+	u32 old = READ_ONCE(lock->val);
+
+	if ((u16) old != old >> TICKET_SHIFT)
+		return FALSE;
+	if (cmpxchg(&lock->val, old, old + (1U << TICKET_SHIFT)) != old)
+		return FALSE;
+
+	lockstat_acquired(&lock->stat, name, lockstat_start(), FALSE);
+	return TRUE;
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+	lockstat_release(&lock->stat);
+	asm volatile ("stlrh %w1, %0" : "=Q" (lock->owner) : "r" ((u32) (u16) (lock->owner + 1)) : "memory");
+}
+
+static inline BOOL spin_is_locked(spinlock_t *lock)
+{
+	u32 val = READ_ONCE(lock->val);
+	return (u16) val != val >> TICKET_SHIFT;
+}
+
+/* The name only matters for LOCKSTAT */
+#define spin_lock(lock)         __spin_lock(lock, #lock)
+#define spin_trylock(lock)      __spin_trylock(lock, #lock)
+
+static inline u64 __spin_lock_irqsave(spinlock_t *lock, const char *name)
+{
+	u64 flags = irq_save();
+	__spin_lock(lock, name);
+	return flags;
+}
+
+#define spin_lock_irqsave(lock) __spin_lock_irqsave(lock, #lock)
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, u64 flags)
+{
+	spin_unlock(lock);
+	irq_restore(flags);
+}
+
+/* MCS lock. Every locker brings a node (on its stack, usually) that it must
+ * hand back to mcs_unlock(); `tail' is the last node in the queue, and the
+ * lock is free while that's NULL.
+ */
+struct mcs_node {
+	struct mcs_node *volatile next;
+	volatile u32 locked;    // set by our predecessor when it's our turn
+};
+
+typedef struct {
+	struct mcs_node *volatile tail;
+	LOCKSTAT_FIELD
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT           { .tail = NULL }
+
+static inline void mcs_lock_init(mcs_lock_t *lock)
+{
+	*lock = (mcs_lock_t) MCS_LOCK_INIT;
+}
+
+static inline void __mcs_lock(mcs_lock_t *lock, struct mcs_node *node, const char *name)
+{
+	u64 start = lockstat_start();
+	struct mcs_node *prev;
+
+	node->next = NULL;
+	node->locked = 0;
+
+	prev = xchg(&lock->tail, node);
+	if (prev) {
+		WRITE_ONCE(prev->next, node);
+		__wfe_wait_ne32(&node->locked, 0);
+	}
+
+	lockstat_acquired(&lock->stat, name, start, prev != NULL);
+}
+
+static inline void mcs_unlock(mcs_lock_t *lock, struct mcs_node *node)
+{
+	struct mcs_node *next = READ_ONCE(node->next);
+
+	lockstat_release(&lock->stat);
+
+	if (!next) {
+		/* nobody queued behind us, unless they're just about to link in */
+		if (cmpxchg(&lock->tail, node, NULL) == node)
+			return;
+		next = (struct mcs_node *) __wfe_wait_ne64((const volatile u64 *) &node->next, 0);
+	}
+
+	smp_store_release(&next->locked, 1);
+}
+
+#define mcs_lock(lock, node)    __mcs_lock(lock, node, #lock)
+
+static inline u64 __mcs_lock_irqsave(mcs_lock_t *lock, struct mcs_node *node, const char *name)
+{
+	u64 flags = irq_save();
+	__mcs_lock(lock, node, name);
+	return flags;
+}
+
+#define mcs_lock_irqsave(lock, node)    __mcs_lock_irqsave(lock, node, #lock)
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t *lock, struct mcs_node *node, u64 flags)
+{
+	mcs_unlock(lock, node);
+	irq_restore(flags);
+}
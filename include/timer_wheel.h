@@ -0,0 +1,98 @@
+/*
+ * timer_wheel.h - coarse timeouts on a hierarchical timer wheel
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "types.h"
+#include "spinlock.h"
+#include "arch_timer.h"
+
+/* For the large numbers of timeouts that rarely fire (network, storage,
+ * scheduler), where the sorted hrtimer list would cost O(n) per insertion.
+ * Expiries are in jiffies of TIMER_WHEEL_TICK_NS; add, modify and delete are
+ * O(1), and expiry is O(1) amortised. Callbacks run from SOFTIRQ_TIMER, up to
+ * one tick late.
+ */
+#define TIMER_WHEEL_TICK_NS     NSEC_PER_MSEC
+
+/* Level 0 has 256 one-jiffy slots, the four above it 64 slots each, every one
+ * covering a whole revolution of the level below; timers further out than
+ * 2^32 jiffies (~49 days) are clamped to that.
+ */
+#define TVR_BITS                8
+#define TVN_BITS                6
+#define TVR_SIZE                (1 << TVR_BITS)
+#define TVN_SIZE                (1 << TVN_BITS)
+#define TVR_MASK                (TVR_SIZE - 1)
+#define TVN_MASK                (TVN_SIZE - 1)
+#define TVN_LEVELS              4
+
+struct timer_list {
+	struct timer_list *next;
+	struct timer_list **pprev;      // NULL while not pending
+	u64 expires;                    // in jiffies
+	void (*function) (struct timer_list *);
+};
+
+/* One wheel for all cores; callbacks run on whichever core the tick fires on.
+ * Every core's mod_timer()s go through the one lock, hence MCS.
+ */
+struct timer_base {
+	mcs_lock_t lock;
+	u64 clk;                        // next jiffy to be processed
+	unsigned long pending;
+	struct timer_list *tv1[TVR_SIZE];
+	struct timer_list *tvn[TVN_LEVELS][TVN_SIZE];
+};
+
+/* Jiffies since the counter started. Derived from the counter on every read
+ * rather than counted by the tick, which is off whenever the wheel is empty:
+ * `get_jiffies() + n' is n jiffies from now even right after an idle stretch.
+ */
+static inline u64 get_jiffies(void)
+{
+	return ktime_get_ns() / TIMER_WHEEL_TICK_NS;
+}
+
+static inline u64 msecs_to_jiffies(u64 ms)
+{
+	return ms * NSEC_PER_MSEC / TIMER_WHEEL_TICK_NS;
+}
+
+void timer_wheel_init(void);
+
+void timer_setup(struct timer_list *timer, void (*function) (struct timer_list *));
+
+/* Arms `timer' to fire at `timer->expires' */
+void add_timer(struct timer_list *timer);
+
+/* (Re)arms `timer' to fire at `expires'; returns TRUE if it was pending */
+BOOL mod_timer(struct timer_list *timer, u64 expires);
+
+/* Returns TRUE if the timer was pending. Doesn't wait for a running callback. */
+BOOL del_timer(struct timer_list *timer);
+
+static inline BOOL timer_pending(const struct timer_list *timer)
+{
+	return timer->pprev != NULL;
+}
+
+#ifdef TIMER_WHEEL_BENCH
+void timer_wheel_bench(void);
+#endif
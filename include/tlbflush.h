@@ -0,0 +1,70 @@
+/*
+ * tlbflush.h - batched TLB maintenance
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+
+/* Unmapping code queues the ranges it has taken out of the page tables on a
+ * tlb_batch and invalidates them all in one go with tlb_batch_flush(). The
+ * invalidation uses the inner-shareable broadcast TLBIs, which every core on
+ * the Pi 3 and 4 is in the domain of, so no other core has to be interrupted:
+ * the final DSB ISH waits for all of them to have dropped the entries.
+ *
+ * Past TLB_FLUSH_FULL_PAGES pages (or TLB_BATCH_RANGES disjoint ranges) the
+ * batch stops tracking addresses and flushes the whole ASID instead.
+ */
+#define TLB_BATCH_RANGES        16
+#define TLB_FLUSH_FULL_PAGES    64
+
+/* Global (nG = 0) mappings, i.e. everything under TTBR1 */
+#define TLB_ASID_KERNEL         (-1)
+
+struct tlb_range {
+	uintptr start, end;     // page aligned, [start, end)
+};
+
+struct tlb_batch {
+	int asid;               // TLB_ASID_KERNEL, or the ASID the ranges were mapped under
+	bool full;              // flush the whole ASID; `ranges' no longer matter
+	unsigned nr;
+	u64 pages;              // covered by `ranges', overlaps merged
+	u64 queued;             // pages passed to tlb_batch_add(), overlaps and all
+	struct tlb_range ranges[TLB_BATCH_RANGES];
+};
+
+void tlb_batch_init(struct tlb_batch *batch, int asid);
+
+/* [va, va + size) has been unmapped; the page tables are already updated */
+void tlb_batch_add(struct tlb_batch *batch, uintptr va, size_t size);
+
+/* Invalidates everything queued on every core, then empties the batch */
+void tlb_batch_flush(struct tlb_batch *batch);
+
+static inline void flush_tlb_kernel_range(uintptr start, uintptr end)
+{
+	struct tlb_batch batch;
+
+	tlb_batch_init(&batch, TLB_ASID_KERNEL);
+	tlb_batch_add(&batch, start, end - start);
+	tlb_batch_flush(&batch);
+}
+
+void tlb_stats_dump(void);
@@ -34,19 +34,30 @@
  *  into ASCII here until it's all actually finalized.
  */
 
-#define CORES			1 // must be a power of 2
+#define CORES			4 // must be a power of 2
 
-#define KERNEL_IMG_MAX_SIZE     (2 * MEGABYTE) // can't be larger than MMU level 2 block descriptor
+#define KERNEL_IMG_MAX_SIZE     (8 * MEGABYTE) // from KERN_VM_BASE, .bss included; mapped in 2MB blocks
 
 #define PAGE_SHIFT              12      // 4K page size
 #define PAGE_SIZE		(1UL << PAGE_SHIFT)
 #define PAGESIZE                PAGE_SIZE
-#define KERN_PGDIR_SIZE         (5 * PAGESIZE)
+#define KERN_PGDIR_SIZE         ((3 + LINEAR_MAP_L2_TABLES) * PAGESIZE) // L0, L1, kernel L2, linear map L2s
 #define KERN_VM_BASE            (0xFFFFUL << 48)
 
-#define STACK_SIZE              (128 * KILOBYTE) // kernel + exception stacks
+/* All of RAM the device tree lists, at LINEAR_MAP_VM_BASE + its physical
+ * address: 1GB blocks where a range covers a whole one, 2MB blocks (from
+ * one of LINEAR_MAP_L2_TABLES tables) for the ends that don't. Without a
+ * tree, just the first LINEAR_MAP_DEFAULT_SIZE, which every board has.
+ */
+#define LINEAR_MAP_VM_BASE      (KERN_VM_BASE | (256UL << 30))
+#define LINEAR_MAP_MAX_PHYS     (254 * GIGABYTE) // up to the MMIO blocks at 510
+#define LINEAR_MAP_L2_TABLES    4
+#define LINEAR_MAP_DEFAULT_SIZE (256 * MEGABYTE)
+
+#define STACK_SIZE              (128 * KILOBYTE) // kernel + exception stacks, per core
 #define EXCEPTION_STACK_SIZE    (STACK_SIZE / 4)
 #define KERN_STACK_SIZE         (3 * EXCEPTION_STACK_SIZE)
+#define EL2_STACK_SIZE          (16 * KILOBYTE) // per core, only used until the drop to EL1
 
 #define PAGETABLE_START_PHYS    (PAGESIZE) // could start at physical 0x0, but that just feels wrong...
 #define KERN_IMG_START_PHYS	0x80000UL // _start gets loaded here
@@ -62,6 +73,12 @@
 // TODO: update once MMU code working
 #define EXCEPTION_STACK_BASE_VM         (KERN_STACK_BASE_VM - KERN_STACK_SIZE) // bottom/initial sp
 
+/* Each core gets its own STACK_SIZE area, core 0's being the one above; they
+ * all sit in the 2MB block mapped at KERN_STACK_BASE_VM. The EL2 stacks grow
+ * down from KERN_STACK_BASE_PHYS, one EL2_STACK_SIZE each.
+ */
+#define CORE_STACK_OFFSET(core)         ((core) * STACK_SIZE)
+
 // TODO: update these once VM layout finalized
 #define KERN_HEAP_START		(KERN_STACK_BASE_PHYS - STACK_SIZE - KERN_IMG_END_PHYS)
 #define KERN_HEAP_MAXSIZE       (KERN_HEAP_START + 4 * MEGABYTE) // this can be revised
@@ -24,10 +24,44 @@
 
 #define BIT(bit)			(1 << (bit))
 
-#define enable_irq()                    do { asm volatile ("\tmsr daifclr, #2\n"); } while (0)
-#define disable_irq()                   do { asm volatile ("\tmsr daifset, #2\n"); } while (0)
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
 
-void delay (unsigned long);
+#define enable_irq()                    do { asm volatile ("\tmsr daifclr, #2\n" ::: "memory"); } while (0)
+#define disable_irq()                   do { asm volatile ("\tmsr daifset, #2\n" ::: "memory"); } while (0)
+#define enable_fiq()                    do { asm volatile ("\tmsr daifclr, #1\n" ::: "memory"); } while (0)
+
+/* Mask IRQs, returning the previous DAIF so that irq_restore() can put it back */
+static inline u64 irq_save(void)
+{
+	u64 daif;
+	asm volatile ("mrs %0, daif\n\tmsr daifset, #2" : "=r" (daif) :: "memory");
+	return daif;
+}
+
+static inline void irq_restore(u64 daif)
+{
+	asm volatile ("msr daif, %0" :: "r" (daif) : "memory");
+}
+
+/* Busy-waits at least the given time, on the generic counter. Waits of more
+ * than a couple of event stream periods (see delay_init()) are spent mostly
+ * in WFE instead of spinning.
+ */
+void ndelay(u64 ns);
+
+static inline void udelay(u64 us)
+{
+	ndelay(us * 1000);
+}
+
+static inline void mdelay(u64 ms)
+{
+	ndelay(ms * 1000000);
+}
+
+/* Turns on this core's timer event stream; until then ndelay() just spins */
+void delay_init(void);
 
 extern void
 memset(void *dest, int val, size_t nbytes)
@@ -19,8 +19,37 @@
  */
 
 #pragma once
+#include "types.h"
 #include "util/memorymap.h"
 
 
 /** ONLY CALLABLE FROM EL2!! */
-void EL2_MMU_bootstrap(void);
\ No newline at end of file
+/* Builds the kernel page tables, then does EL2_MMU_enable(); core 0 only */
+void EL2_MMU_bootstrap(void);
+
+/* Points this core's EL1 translation at the tables built by EL2_MMU_bootstrap()
+ * and turns on the MMU and caches
+ */
+void EL2_MMU_enable(void);
+
+/* Where the linear map has RAM at `phys'; only for RAM that fdt_parse() found
+ * (or the first LINEAR_MAP_DEFAULT_SIZE without a tree)
+ */
+static inline void *phys_to_virt(uintptr phys)
+{
+	return (void *) (LINEAR_MAP_VM_BASE + phys);
+}
+
+/* Physical address of a mapped kernel address, through the live tables
+ * (AT S1E1R), or 0 if it isn't mapped. PAR_EL1 is shared with anyone else
+ * translating on this core, so IRQs must be masked.
+ */
+static inline uintptr virt_to_phys(const void *va)
+{
+	u64 par;
+
+	asm volatile ("at s1e1r, %1\n\tisb\n\tmrs %0, par_el1" : "=r" (par) : "r" (va) : "memory");
+	if (par & 1) // F: translation aborted
+		return 0;
+	return (par & 0x0000FFFFFFFFF000UL) | ((uintptr) va & (PAGESIZE - 1));
+}
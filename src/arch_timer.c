@@ -0,0 +1,88 @@
+/*
+ * arch_timer.c - ARM generic timer clockevent
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arch_timer.h"
+#include "exceptions.h"
+#include "mmio.h"
+#include "peripherals/irqchip.h"
+#include "util/utils.h"
+
+#define CNTP_CTL_ENABLE         BIT(0)
+#define CNTP_CTL_IMASK          BIT(1)
+
+/* Above everything else, so that a slow device handler can't make us late */
+#define ARCH_TIMER_PRIO         0x40
+
+u64 arch_timer_hz;
+
+static void (*timer_event_handler) (void);
+
+static inline void cntp_write_ctl(u64 ctl)
+{
+	asm volatile ("msr cntp_ctl_el0, %0\n\tisb" :: "r" (ctl) : "memory");
+}
+
+void arch_timer_set_next_event(u64 ticks)
+{
+	asm volatile ("msr cntp_cval_el0, %0" :: "r" (ticks));
+	cntp_write_ctl(CNTP_CTL_ENABLE);
+}
+
+void arch_timer_stop(void)
+{
+	cntp_write_ctl(0);
+}
+
+/* The timer output is level-sensitive and stays asserted for as long as the
+ * deadline is in the past, so stop it before the handler gets to reprogram it.
+ */
+static void arch_timer_irq(void *arg)
+{
+	(void) arg;
+
+	cntp_write_ctl(0);
+	if (timer_event_handler)
+		timer_event_handler();
+}
+
+/* On the BCM2836 local controller this enables the CNTPNS line in core 0's
+ * ARM_LOCAL_TIMER_INT_CONTROL0 (each core has its own control register and gets
+ * its own timer's interrupt only); on the GIC it's the per-core PPI 30.
+ */
+void arch_timer_init(void (*event_handler) (void))
+{
+	arch_timer_hz = arch_timer_freq();
+
+	cntp_write_ctl(0);
+	timer_event_handler = event_handler;
+
+	request_irq(ARM_IRQLOCAL0_CNTPNS, arch_timer_irq, NULL);
+	irq_set_priority(ARM_IRQLOCAL0_CNTPNS, ARCH_TIMER_PRIO);
+}
+
+/* The handler is already registered; all that's left is the calling core's own
+ * (banked) enable and priority for the line.
+ */
+void arch_timer_init_secondary(void)
+{
+	cntp_write_ctl(0);
+	irqchip_set_priority(ARM_IRQLOCAL0_CNTPNS, ARCH_TIMER_PRIO);
+	irqchip_unmask(ARM_IRQLOCAL0_CNTPNS);
+}
@@ -0,0 +1,192 @@
+/*
+ * cpufreq.c - ARM clock scaling
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cpufreq.h"
+#include "firmware.h"
+#include "peripherals/mailbox.h"
+#include "printk.h"
+#include "sched.h"
+#include "smp.h"
+#include "util/utils.h"
+
+#define CPUFREQ_PRIO            (SCHED_PRIO_DEFAULT - 8) // sleeps nearly all the time
+
+enum cpufreq_reason {
+	CPUFREQ_LOAD_UP,
+	CPUFREQ_LOAD_DOWN,
+	CPUFREQ_THERMAL,
+	NR_CPUFREQ_REASONS,
+};
+
+static const char *const reason_names[NR_CPUFREQ_REASONS] = {
+	[CPUFREQ_LOAD_UP] = "load up",
+	[CPUFREQ_LOAD_DOWN] = "load down",
+	[CPUFREQ_THERMAL] = "thermal",
+};
+
+/* Only the governor thread writes any of this */
+static struct {
+	u32 levels[CPUFREQ_MAX_LEVELS];         // Hz, ascending
+	unsigned nr_levels;
+	unsigned cur;
+	u32 temp_limit;                         // millidegrees C
+	u32 temp_last;
+
+	u64 last_sample;                        // counter value
+	u64 idle_last[CORES];
+
+	u64 time_in_level[CPUFREQ_MAX_LEVELS];  // counter ticks
+	u64 transitions[NR_CPUFREQ_REASONS];
+	u64 failures;                           // firmware refused or timed out
+} cpufreq;
+
+static int fw_get(u32 tag, u32 id, u32 *out)
+{
+	u32 val[2] = { id, 0 };
+
+	if (mbox_property_tag(tag, val, 2) < 0)
+		return -1;
+	*out = val[1];
+	return 0;
+}
+
+static int fw_set_arm_rate(u32 hz)
+{
+	u32 val[3] = { MBOX_CLOCK_ARM, hz, 0 }; // 0: let the firmware apply turbo settings
+
+	return mbox_property_tag(MBOX_TAG_SET_CLOCK_RATE, val, 3);
+}
+
+/* Percent busy of the busiest online core since the last sample */
+static unsigned sample_load(u64 now)
+{
+	u64 elapsed = now - cpufreq.last_sample;
+	unsigned load = 0;
+
+	for (unsigned cpu = 0; cpu < CORES; cpu++) {
+		u64 idle = sched_idle_ticks(cpu);
+		u64 delta = idle - cpufreq.idle_last[cpu];
+
+		cpufreq.idle_last[cpu] = idle;
+		if (!(cpu_online_mask & BIT(cpu)) || !elapsed)
+			continue;
+
+		unsigned busy = delta >= elapsed ? 0 : 100 - delta * 100 / elapsed;
+		if (busy > load)
+			load = busy;
+	}
+
+	cpufreq.last_sample = now;
+	return load;
+}
+
+static void set_level(unsigned level, enum cpufreq_reason why)
+{
+	if (level == cpufreq.cur)
+		return;
+
+	if (fw_set_arm_rate(cpufreq.levels[level]) < 0) {
+		cpufreq.failures++;
+		return;
+	}
+
+	cpufreq.cur = level;
+	cpufreq.transitions[why]++;
+}
+
+static void cpufreq_governor(void *arg)
+{
+	(void) arg;
+
+	while (1) {
+		thread_sleep_ns(CPUFREQ_PERIOD_NS);
+
+		u64 now = arch_counter_read();
+		cpufreq.time_in_level[cpufreq.cur] += now - cpufreq.last_sample;
+		unsigned load = sample_load(now);
+		unsigned cur = cpufreq.cur;
+		u32 temp;
+
+		if (fw_get(MBOX_TAG_GET_TEMPERATURE, 0, &temp) < 0) {
+			cpufreq.failures++;
+			temp = cpufreq.temp_limit; // can't tell: don't go up
+		}
+		cpufreq.temp_last = temp;
+
+		if (temp >= cpufreq.temp_limit) {
+			if (cur > 0)
+				set_level(cur - 1, CPUFREQ_THERMAL);
+		} else if (load > CPUFREQ_UP_LOAD) {
+			if (temp + CPUFREQ_THERMAL_HYST < cpufreq.temp_limit)
+				set_level(cpufreq.nr_levels - 1, CPUFREQ_LOAD_UP);
+		} else if (load < CPUFREQ_DOWN_LOAD && cur > 0) {
+			set_level(cur - 1, CPUFREQ_LOAD_DOWN);
+		}
+	}
+}
+
+/* The limits come from what firmware_info_fetch() got at boot */
+void cpufreq_init(void)
+{
+	u32 min = firmware_info.arm_clock_min, max = firmware_info.arm_clock_max;
+	u32 rate = firmware_info.arm_clock, temp_max = firmware_info.temp_max;
+
+	if (!firmware_info.valid || !min || !temp_max || min > max) {
+		printk("cpufreq: firmware not answering, leaving the ARM clock alone\r\n");
+		return;
+	}
+
+	for (u32 hz = min; hz < max && cpufreq.nr_levels < CPUFREQ_MAX_LEVELS - 1; hz += CPUFREQ_STEP_HZ)
+		cpufreq.levels[cpufreq.nr_levels++] = hz;
+	cpufreq.levels[cpufreq.nr_levels++] = max;
+
+	/* start from wherever the firmware left it */
+	while (cpufreq.cur + 1 < cpufreq.nr_levels && cpufreq.levels[cpufreq.cur + 1] <= rate)
+		cpufreq.cur++;
+
+	cpufreq.temp_limit = temp_max - CPUFREQ_THERMAL_MARGIN;
+	cpufreq.last_sample = arch_counter_read();
+	for (unsigned cpu = 0; cpu < CORES; cpu++)
+		cpufreq.idle_last[cpu] = sched_idle_ticks(cpu);
+
+	printk("cpufreq: ARM %u-%u MHz in %u steps, now %u MHz; backing off at %u.%u C\r\n",
+	       min / 1000000, max / 1000000, cpufreq.nr_levels, rate / 1000000,
+	       cpufreq.temp_limit / 1000, cpufreq.temp_limit % 1000 / 100);
+
+	if (!thread_create("cpufreq", cpufreq_governor, NULL, CPUFREQ_PRIO))
+		printk("cpufreq: no thread slot for the governor\r\n");
+}
+
+void cpufreq_stats_dump(void)
+{
+	if (!cpufreq.nr_levels)
+		return;
+
+	printk("cpufreq: %u MHz at %u.%u C;", cpufreq.levels[cpufreq.cur] / 1000000,
+	       cpufreq.temp_last / 1000, cpufreq.temp_last % 1000 / 100);
+	for (unsigned why = 0; why < NR_CPUFREQ_REASONS; why++)
+		printk(" %lu %s", cpufreq.transitions[why], reason_names[why]);
+	printk(", %lu failed\r\n", cpufreq.failures);
+
+	for (unsigned level = 0; level < cpufreq.nr_levels; level++)
+		if (cpufreq.time_in_level[level])
+			printk("  %4u MHz: %lu ms\r\n", cpufreq.levels[level] / 1000000,
+			       arch_ticks_to_ns(cpufreq.time_in_level[level]) / NSEC_PER_MSEC);
+}
@@ -19,43 +19,66 @@
  */
 
 #include "exceptions.h"
-#include "peripherals/mini_uart.h"
+#include "drivers/console.h"
 #include "mmio.h"
+#include "peripherals/irqchip.h"
 #include "printk.h"
+#include "irqstat.h"
+#include "softirq.h"
+#include "sched.h"
+#include "percpu.h"
+#include "rcu.h"
+#include "spinlock.h"
+#include "arch_timer.h"
+#include "util/utils.h"
+#include "util/memorymap.h"
+#include "assert.h"
 
-extern void uart0_irq_handler(void);
-
+/* Read on every interrupt, written about once: published with RCU */
 static int_handler_t KOS_handlers[KOS_IRQ_NUM] = {NULL};
 
+static_assert(offsetof(struct ExceptionFrame, x[19]) == FRAME_X(19));
+static_assert(offsetof(struct ExceptionFrame, sp_el0) == FRAME_SP_EL0);
+static_assert(offsetof(struct ExceptionFrame, elr_el1) == FRAME_ELR);
+static_assert(offsetof(struct ExceptionFrame, spsr_el1) == FRAME_SPSR);
+static_assert(offsetof(struct ExceptionFrame, q[0]) == FRAME_Q(0));
+static_assert(sizeof(struct ExceptionFrame) == FRAME_SIZE);
+static_assert(FRAME_SIZE % 16 == 0); /* sp must stay 16-byte aligned */
+
+static DEFINE_PER_CPU(volatile BOOL, need_resched);
+
 void call_KOS_handler(IntType which)
 {
-	if (KOS_handlers[which])
-		(*KOS_handlers[which]) ();
+	int_handler_t handler = rcu_dereference(KOS_handlers[which]);
+
+	if (handler)
+		(*handler) ();
 }
 
 __attribute__((optimize(0))) // prevent compiler optimizing out `context` parameter
 _Noreturn void InvalidExceptionHandler(int type, int currentEL, struct ExceptionContext *context)
 {
 #ifdef DEBUG
-	muart_send_str("Invalid exception: ");
+	console_panic();
+	printk("Invalid exception: ");
 	switch (type) {
 		case E_SYNC:
-			muart_send_str("E_SYNC\r\n");
+			printk("E_SYNC\r\n");
 			break;
 		case E_FIQ:
-			muart_send_str("E_FIQ\r\n");
+			printk("E_FIQ\r\n");
 			break;
 		case E_32BIT:
-			muart_send_str("E_32BIT\r\n");
+			printk("E_32BIT\r\n");
 			break;
 		case E_BADIRQ:
-			muart_send_str("E_BADIRQ\r\n");
+			printk("E_BADIRQ\r\n");
 			break;
 		case E_TODO:
-			muart_send_str("E_TODO\r\n");
+			printk("E_TODO\r\n");
 			break;
 		default:
-			muart_send_str("Unknown\r\n");
+			printk("Unknown\r\n");
 	}
 #endif
 	// TRAP here to read out members of `context` because
@@ -64,51 +87,358 @@ _Noreturn void InvalidExceptionHandler(int type, int currentEL, struct Exception
 		;
 }
 
-__attribute__((optimize(2)))
-void irq_handler(void)
+void irq_set_need_resched(void)
+{
+	__this_cpu_write(need_resched, TRUE);
+}
+
+void irq_reschedule(struct ExceptionFrame *frame)
+{
+	sched_switch(frame);
+}
+
+/* SVC #0 from EL1: a thread giving up the CPU (see sched.c) */
+void svc_handler(struct ExceptionFrame *frame)
+{
+	sched_switch(frame);
+}
+
+/* How many irq_handler()s are live on this core's exception stack */
+static DEFINE_PER_CPU(unsigned, irq_depth);
+
+/* Outside of an IRQ it's 0 on whichever core we are on, so no need to mask */
+BOOL in_interrupt(void)
 {
-	/* We have 3 registers for the pending IRQ's, but for our purposes
-	 * the only IRQ's we *should* be dealing with are timer interrupts
-	 * and console read/write interrupts (a.k.a. UART0 interrupts).
-	 * Just to be safe, let's still just check everything
+	return __this_cpu_read(irq_depth) != 0;
+}
+
+/* Tells the stub whether it needs to take the slow (full frame) way out */
+static inline int irq_exit(void)
+{
+	/* We interrupted another handler (or its softirqs): it's the outermost
+	 * exception's job to switch, once everything below it has unwound.
 	 */
-	u32 pending[3] = {
-		vmmio_read32(ARM_IC_IRQ_PENDING_1),
-		vmmio_read32(ARM_IC_IRQ_PENDING_2),
-		vmmio_read32(ARM_IC_IRQ_BASIC_PENDING) & 0xFF,
-	};
+	unsigned *depth = this_cpu_ptr(&irq_depth);
+	volatile BOOL *resched = this_cpu_ptr(&need_resched);
 
-	for (unsigned reg = 0; reg < 3; reg++) {
-		u32 pend = pending[reg];
+	if (--*depth)
+		return 0;
 
-		if (!pend)
-			continue;
+	int was = *resched;
+	*resched = FALSE;
 
-		/* Note: although __builtin_ctz(0) returns 0 on x86(_64),
-		 * testing on aarch64 Linux with native GCC shows that it
-		 * returns 32 there, which is what we want here.
-		 */
-		u32 irq_n = __builtin_ctz(pend);
-		if (reg == 1 && irq_n == __builtin_ctz(ARM_IRQ_UART)) /* UART */ {
-			uart0_irq_handler();
-			return;
+	/* a thread isn't switched out inside rcu_read_lock(); it yields itself
+	 * from rcu_read_unlock() instead
+	 */
+	if (was) {
+		struct thread *curr = thread_current();
+
+		if (curr->rcu_nesting) {
+			curr->rcu_resched = TRUE;
+			return 0;
 		}
-		vmmio_write32(ARM_IC_IRQ_PENDING_1, 0);
-		vmmio_write32(ARM_IC_IRQ_PENDING_2, 0);
-		vmmio_write32(ARM_IC_IRQ_BASIC_PENDING, 0);
+	}
+	return was;
+}
+
+struct irq_action {
+	irq_handler_t handler;
+	void *arg;
+	u8 prio;
+};
+
+/* irq_handler() looks lines up in `irq_table' without a lock, from IRQ
+ * context (an RCU read-side section of its own). The actions themselves live
+ * in `irq_actions', one per line; a line's slot stays taken until free_irq()
+ * has waited out everyone who could still be using it. Writers hold
+ * irq_table_lock.
+ */
+static struct irq_action irq_actions[IRQ_LINES];
+static struct irq_action *irq_table[IRQ_LINES];
+static spinlock_t irq_table_lock = SPINLOCK_INIT;
+static unsigned fiq_irq = IRQ_SPURIOUS; // the line request_fiq() took, if any
+
+int request_irq(unsigned irq, irq_handler_t handler, void *arg)
+{
+	if (irq >= IRQ_LINES || handler == NULL)
+		return -1;
+
+	u64 daif = spin_lock_irqsave(&irq_table_lock);
+	struct irq_action *act = &irq_actions[irq];
+
+	if (act->handler || irq == fiq_irq) {
+		spin_unlock_irqrestore(&irq_table_lock, daif);
+		return -1;
+	}
+
+	act->handler = handler;
+	act->arg = arg;
+	act->prio = IRQ_PRIO_DEFAULT;
+	irqchip_set_priority(irq, IRQ_PRIO_DEFAULT);
+	rcu_assign_pointer(irq_table[irq], act);
+	irqchip_unmask(irq);
+	spin_unlock_irqrestore(&irq_table_lock, daif);
+
+	return 0;
+}
+
+void free_irq(unsigned irq)
+{
+	if (irq >= IRQ_LINES)
+		return;
+
+	u64 daif = spin_lock_irqsave(&irq_table_lock);
+	irqchip_mask(irq);
+	RCU_INIT_POINTER(irq_table[irq], NULL);
+	spin_unlock_irqrestore(&irq_table_lock, daif);
+
+	/* a handler already running on another core may still be using `arg' */
+	synchronize_rcu();
+
+	daif = spin_lock_irqsave(&irq_table_lock);
+	irq_actions[irq].handler = NULL;
+	irq_actions[irq].arg = NULL;
+	irq_actions[irq].prio = IRQ_PRIO_HIGHEST;
+	spin_unlock_irqrestore(&irq_table_lock, daif);
+}
+
+void irq_set_priority(unsigned irq, u8 prio)
+{
+	if (irq >= IRQ_LINES)
+		return;
+	if (prio > IRQ_PRIO_LOWEST)
+		prio = IRQ_PRIO_LOWEST;
+
+	u64 daif = spin_lock_irqsave(&irq_table_lock);
+	if (irq_table[irq]) {
+		WRITE_ONCE(irq_table[irq]->prio, prio);
+		irqchip_set_priority(irq, prio);
+	}
+	spin_unlock_irqrestore(&irq_table_lock, daif);
+}
+
+static inline void handle_irq(unsigned irq, const struct irq_action *act)
+{
+	if (__builtin_expect(act != NULL, 1)) {
+		act->handler(act->arg);
+		return;
+	}
+
+	/* Nobody wants it. On the BCM2835 the pending bits just mirror the (level-triggered)
+	 * device lines, so writing to the pending registers does nothing; mask the line
+	 * instead of taking it again on the way out.
+	 */
+	irqchip_mask(irq);
 #ifdef DEBUG
-		printk("IRQ #%d asserted on line %d\r\n", irq_n, reg);
+	printk("Spurious IRQ #%u masked\r\n", irq);
 #endif
+}
+
+static void fiq_unexpected(void *arg)
+{
+	(void) arg;
+}
+
+/* Used directly by FIQStubEL1 in vectors.S */
+struct fiq_action {
+	fiq_handler_t handler;
+	void *arg;
+};
 
+struct fiq_action fiq_action = { fiq_unexpected, NULL };
+u8 fiq_stacks[CORES][FIQ_STACK_SIZE] __attribute__((aligned(16)));
+
+int request_fiq(unsigned irq, fiq_handler_t handler, void *arg)
+{
+	if (irq >= IRQ_LINES || handler == NULL)
+		return -1;
+
+	u64 daif = spin_lock_irqsave(&irq_table_lock);
+	int ret = -1;
+
+	if (fiq_irq != IRQ_SPURIOUS || irq_actions[irq].handler)
+		goto out;
+
+	/* Fill this in before anything can fire */
+	fiq_action.arg = arg;
+	fiq_action.handler = handler;
+	wmb();
+	if (irqchip_route_fiq(irq) < 0) {
+		fiq_action.handler = fiq_unexpected;
+		goto out;
 	}
+
+	fiq_irq = irq;
+	ret = 0;
+out:
+	spin_unlock_irqrestore(&irq_table_lock, daif);
+	return ret;
 }
 
+void free_fiq(void)
+{
+	u64 daif = spin_lock_irqsave(&irq_table_lock);
+
+	if (fiq_irq != IRQ_SPURIOUS) {
+		irqchip_unroute_fiq(fiq_irq);
+		asm volatile ("dsb sy" ::: "memory"); // routing change has landed before the handler goes away
+		fiq_action.handler = fiq_unexpected;
+		fiq_action.arg = NULL;
+		fiq_irq = IRQ_SPURIOUS;
+	}
+	spin_unlock_irqrestore(&irq_table_lock, daif);
+}
+
+#ifdef FIQ_BENCH
+
+#define FIQ_BENCH_SAMPLES       1000
+#define FIQ_BENCH_DELAY_US      50
+
+/* Counter ticks from the CNTV deadline to the handler, plus one; 0 while waiting */
+static volatile u64 fiq_bench_late;
+
+static inline u64 cntv_read(void)
+{
+	u64 cnt;
+
+	asm volatile ("isb\n\tmrs %0, cntvct_el0" : "=r" (cnt) :: "memory");
+	return cnt;
+}
+
+static void fiq_bench_handler(void *arg)
+{
+	u64 now = cntv_read(), cval;
+
+	(void) arg;
+	asm volatile ("mrs %0, cntv_cval_el0" : "=r" (cval));
+	asm volatile ("msr cntv_ctl_el0, xzr\n\tisb" ::: "memory"); // drops the line
+	fiq_bench_late = now - cval + 1;
+}
+
+static void fiq_bench_run(const char *path)
+{
+	u64 min = ~0UL, max = 0, sum = 0;
+
+	for (unsigned i = 0; i < FIQ_BENCH_SAMPLES; i++) {
+		u64 cval = cntv_read() + arch_ns_to_ticks(FIQ_BENCH_DELAY_US * NSEC_PER_USEC);
+
+		fiq_bench_late = 0;
+		asm volatile ("msr cntv_cval_el0, %0\n\tmsr cntv_ctl_el0, %1\n\tisb"
+			      :: "r" (cval), "r" (1UL) : "memory");
+		while (!fiq_bench_late)
+			asm volatile ("yield");
+
+		u64 late = fiq_bench_late - 1;
+		sum += late;
+		if (late < min)
+			min = late;
+		if (late > max)
+			max = late;
+	}
+
+	printk("%s: CNTV deadline to handler min %lu avg %lu max %lu ns (in steps of %lu ns)\r\n",
+	       path, arch_ticks_to_ns(min), arch_ticks_to_ns(sum / FIQ_BENCH_SAMPLES),
+	       arch_ticks_to_ns(max), arch_ticks_to_ns(1));
+}
 
+/* The same timer line, taken once as an IRQ and once as an FIQ, on whatever
+ * else this core is doing at the time
+ */
+void fiq_bench(void)
+{
+	if (request_irq(ARM_IRQLOCAL0_CNTV, fiq_bench_handler, NULL) < 0) {
+		printk("fiq bench: CNTV line is taken\r\n");
+		return;
+	}
+	fiq_bench_run("IRQ");
+	free_irq(ARM_IRQLOCAL0_CNTV);
+
+	if (request_fiq(ARM_IRQLOCAL0_CNTV, fiq_bench_handler, NULL) < 0) {
+		printk("fiq bench: this irqchip can't route CNTV to FIQ\r\n");
+		return;
+	}
+	fiq_bench_run("FIQ");
+	free_fiq();
+}
+
+#endif /* FIQ_BENCH */
+
+/* `entry_ts' is irqstat_clock() as read by the vector stub on entry.
+ *
+ * Handlers run with IRQs unmasked, except for class 0 (see irqchip.h); the
+ * controller only lets more urgent classes through until irqchip_eoi(), by
+ * running priority on the GIC and by disabling the other lines on the BCM2835.
+ * A nested IRQ gets its own frame on the exception stack, below the one it
+ * interrupted, so the exception stack needs room for one frame (~1K with the
+ * C part) per class in use plus one for the softirq level.
+ *
+ * Worst-case latency for a line in the most urgent class in use is the longest
+ * stretch with IRQs masked on the CPU, which is the largest of:
+ *      - the stub entry and exit (~40 stores/loads each, plus 32 q registers)
+ *      - irqchip_ack()/irqchip_eoi() of a less urgent line: one IAR read or EOIR
+ *        write on the GIC; on the BCM2835 the pending register reads plus up to
+ *        3 disable/enable writes and 2 read-modify-writes of the local controls
+ *      - the short irq_save() sections in softirq.c and the drivers
+ *      - any class 0 handler, which can't be preempted at all
+ * plus the stub entry and the ack for the line itself. With nothing in class 0
+ * that comes to a handful of device register accesses (well under 1us at the
+ * BCM2835's ~100-200ns per access), independent of how long less urgent
+ * handlers, softirqs or KOS callbacks take.
+ */
+__attribute__((optimize(2)))
+int irq_handler(u64 entry_ts)
+{
+	BOOL stats = irqstat_enabled, first = TRUE;
+	u32 ack;
+
+	__this_cpu_add(irq_depth, 1);
+
+	/* Keep going until the controller has nothing left for us, including
+	 * anything that came in while we were at it, so that a burst gets
+	 * drained in one exception rather than one per source.
+	 */
+	while ((ack = irqchip_ack()) != IRQ_SPURIOUS) {
+		unsigned irq = IRQCHIP_IRQ(ack);
+		const struct irq_action *act = irq < IRQ_LINES ? rcu_dereference(irq_table[irq]) : NULL;
+		BOOL nest = act && IRQ_PRIO_CLASS(act->prio) != 0;
+		u64 dispatch = __builtin_expect(stats, 0) ? irqstat_clock() : 0;
+
+		if (nest)
+			enable_irq();
+		handle_irq(irq, act);
+		if (nest)
+			disable_irq();
+
+		/* handler time includes anything that preempted it */
+		if (__builtin_expect(stats, 0))
+			irqstat_record(irq, first, entry_ts, dispatch, irqstat_clock());
+		first = FALSE;
+		irqchip_eoi(ack);
+	}
+
+	/* Bottom halves run with IRQs unmasked, once we're back down to the
+	 * outermost level; anything arriving meanwhile nests on top.
+	 */
+	if (__this_cpu_read(irq_depth) == 1) {
+		/* the handlers are done; unless the thread we interrupted is a
+		 * reader, nothing on this core holds an RCU reference now
+		 */
+		if (__builtin_expect(__this_cpu_read(rcu_qs_wanted), 0) && !thread_current()->rcu_nesting)
+			rcu_report_qs();
+		do_softirq();
+	}
+
+	/* Everything between here and the eret is a fixed-length register restore */
+	if (__builtin_expect(stats, 0))
+		irqstat_record_exit(entry_ts, irqstat_clock());
+
+	return irq_exit();
+}
 
 void register_isr(IntType which, int_handler_t handler)
 {
 	if (which >= KOS_IRQ_NUM)
 		return;
 
-	KOS_handlers[which] = handler;
+	rcu_assign_pointer(KOS_handlers[which], handler);
 }
\ No newline at end of file
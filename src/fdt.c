@@ -0,0 +1,393 @@
+/*
+ * fdt.c - flattened device tree parsing at boot
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fdt.h"
+#include "mmio.h"
+#include "printk.h"
+#include "util/utils.h"
+
+#define FDT_MAGIC               0xD00DFEED
+#define FDT_MIN_VERSION         16
+#define FDT_MAX_SIZE            (1 * MEGABYTE)  // sanity limit, the Pi's are ~50K
+
+#define FDT_BEGIN_NODE          1
+#define FDT_END_NODE            2
+#define FDT_PROP                3
+#define FDT_NOP                 4
+#define FDT_END                 9
+
+#define FDT_MAX_DEPTH           16
+#define SOC_BUS_BASE            0x7E000000UL    // where the peripherals sit on the VC bus
+
+struct fdt_header {
+	u32 magic;
+	u32 totalsize;
+	u32 off_dt_struct;
+	u32 off_dt_strings;
+	u32 off_mem_rsvmap;
+	u32 version;
+	u32 last_comp_version;
+	u32 boot_cpuid_phys;
+	u32 size_dt_strings;
+	u32 size_dt_struct;
+};
+
+/* The nodes we care about, by where they are in the tree */
+enum fdt_ctx {
+	CTX_OTHER,
+	CTX_ROOT,
+	CTX_MEMORY,                     // /memory@...
+	CTX_RESERVED,                   // /reserved-memory
+	CTX_RESERVED_CHILD,             // /reserved-memory/...
+	CTX_CPUS,                       // /cpus
+	CTX_SOC,                        // /soc
+};
+
+struct fdt_level {
+	enum fdt_ctx ctx;
+	u32 addr_cells, size_cells;     // for this node's children
+};
+
+/* In .data: _start gets here before the .bss is zeroed */
+struct boot_info boot_info __attribute__((section(".data")));
+
+/* The MMU is off, so the tree is Device memory: aligned single accesses
+ * only, which volatile also keeps the compiler from widening or vectorising.
+ */
+static inline u32 be32(uintptr p)
+{
+	return __builtin_bswap32(*(const volatile u32 *) p);
+}
+
+static inline u8 byte(uintptr p)
+{
+	return *(const volatile u8 *) p;
+}
+
+static BOOL str_eq(uintptr s, const char *lit)
+{
+	while (*lit)
+		if (byte(s++) != (u8) *lit++)
+			return FALSE;
+	return byte(s) == 0;
+}
+
+/* "name" or "name@unit" */
+static BOOL node_is(uintptr s, const char *lit)
+{
+	while (*lit)
+		if (byte(s++) != (u8) *lit++)
+			return FALSE;
+	return byte(s) == 0 || byte(s) == '@';
+}
+
+static u64 read_cells(uintptr p, u32 cells)
+{
+	u64 v = 0;
+
+	while (cells--) {
+		v = v << 32 | be32(p);
+		p += 4;
+	}
+	return v;
+}
+
+static void add_range(struct mem_range *ranges, unsigned *nr, unsigned max, u64 base, u64 size)
+{
+	if (!size)
+		return;
+	if (*nr == max) {
+		boot_info.truncated = TRUE;
+		return;
+	}
+	ranges[*nr].base = base;
+	ranges[*nr].size = size;
+	(*nr)++;
+}
+
+/* A reg property: (address, size) pairs in the parent's cells */
+static void parse_reg(uintptr val, u32 len, const struct fdt_level *parent, BOOL reserved)
+{
+	u32 entry = (parent->addr_cells + parent->size_cells) * 4;
+
+	if (!entry || parent->addr_cells > 2 || parent->size_cells > 2)
+		return;
+
+	for (u32 off = 0; off + entry <= len; off += entry) {
+		u64 base = read_cells(val + off, parent->addr_cells);
+		u64 size = read_cells(val + off + parent->addr_cells * 4, parent->size_cells);
+
+		if (reserved)
+			add_range(boot_info.reserved, &boot_info.nr_reserved, BOOT_MAX_RESERVED, base, size);
+		else
+			add_range(boot_info.mem, &boot_info.nr_mem, BOOT_MAX_MEM_RANGES, base, size);
+	}
+}
+
+/* /soc ranges: (child address, parent address, size) in the soc's, the
+ * root's and the soc's cells respectively
+ */
+static void parse_soc_ranges(uintptr val, u32 len, const struct fdt_level *root,
+			     const struct fdt_level *soc)
+{
+	u32 entry = (soc->addr_cells + root->addr_cells + soc->size_cells) * 4;
+
+	if (!entry || soc->addr_cells > 2 || root->addr_cells > 2 || soc->size_cells > 2)
+		return;
+
+	for (u32 off = 0; off + entry <= len; off += entry) {
+		u64 child = read_cells(val + off, soc->addr_cells);
+		u64 parent = read_cells(val + off + soc->addr_cells * 4, root->addr_cells);
+		u64 size = read_cells(val + off + (soc->addr_cells + root->addr_cells) * 4,
+				      soc->size_cells);
+
+		if (child <= SOC_BUS_BASE && SOC_BUS_BASE < child + size) {
+			boot_info.mmio_base = parent + (SOC_BUS_BASE - child);
+			return;
+		}
+	}
+}
+
+static void parse_rsvmap(uintptr p, uintptr end)
+{
+	for (; p + 16 <= end; p += 16) {
+		u64 base = read_cells(p, 2), size = read_cells(p + 8, 2);
+
+		if (!base && !size)
+			break;
+		add_range(boot_info.reserved, &boot_info.nr_reserved, BOOT_MAX_RESERVED, base, size);
+	}
+}
+
+static enum fdt_ctx child_ctx(enum fdt_ctx parent, uintptr name)
+{
+	switch (parent) {
+	case CTX_ROOT:
+		if (node_is(name, "memory"))
+			return CTX_MEMORY;
+		if (node_is(name, "reserved-memory"))
+			return CTX_RESERVED;
+		if (node_is(name, "cpus"))
+			return CTX_CPUS;
+		if (node_is(name, "soc"))
+			return CTX_SOC;
+		return CTX_OTHER;
+	case CTX_RESERVED:
+		return CTX_RESERVED_CHILD;
+	case CTX_CPUS:
+		if (node_is(name, "cpu"))
+			boot_info.nr_cpus++;
+		return CTX_OTHER;
+	default:
+		return CTX_OTHER;
+	}
+}
+
+void fdt_parse(u64 dtb_phys)
+{
+	uintptr base = dtb_phys;
+	const struct fdt_header *h = (const struct fdt_header *) base;
+	struct fdt_level stack[FDT_MAX_DEPTH];
+	int depth = -1;
+	uintptr soc_ranges = 0;
+	u32 soc_ranges_len = 0;
+
+	if (!base || (base & 3) || be32((uintptr) &h->magic) != FDT_MAGIC)
+		return;
+
+	u32 size = be32((uintptr) &h->totalsize);
+	u32 off_struct = be32((uintptr) &h->off_dt_struct);
+	u32 off_strings = be32((uintptr) &h->off_dt_strings);
+	u32 size_struct = be32((uintptr) &h->size_dt_struct);
+	u32 size_strings = be32((uintptr) &h->size_dt_strings);
+	u32 off_rsvmap = be32((uintptr) &h->off_mem_rsvmap);
+
+	if (be32((uintptr) &h->version) < FDT_MIN_VERSION || size > FDT_MAX_SIZE
+	    || off_struct + size_struct > size || off_strings + size_strings > size
+	    || off_rsvmap >= size || (off_struct & 3) || (off_rsvmap & 7))
+		return;
+
+	boot_info.dtb_phys = dtb_phys;
+	boot_info.dtb_size = size;
+	parse_rsvmap(base + off_rsvmap, base + size);
+
+	uintptr p = base + off_struct, end = p + size_struct;
+	uintptr strings = base + off_strings;
+
+	while (p + 4 <= end) {
+		u32 token = be32(p);
+		p += 4;
+
+		switch (token) {
+		case FDT_BEGIN_NODE: {
+			uintptr name = p;
+			enum fdt_ctx ctx;
+
+			while (p < end && byte(p))
+				p++;
+			p = (p + 4) & ~3UL; // past the NUL, to the next token
+
+			if (depth + 1 >= FDT_MAX_DEPTH)
+				goto fail;
+			ctx = depth < 0 ? CTX_ROOT : child_ctx(stack[depth].ctx, name);
+			depth++;
+			stack[depth].ctx = ctx;
+			stack[depth].addr_cells = 2; // the spec's defaults
+			stack[depth].size_cells = 1;
+			break;
+		}
+
+		case FDT_END_NODE:
+			if (depth < 0)
+				goto fail;
+			/* the soc's own cells may come after its ranges */
+			if (stack[depth].ctx == CTX_SOC && soc_ranges)
+				parse_soc_ranges(soc_ranges, soc_ranges_len, &stack[depth - 1], &stack[depth]);
+			if (--depth < 0)
+				goto done;
+			break;
+
+		case FDT_PROP: {
+			if (p + 8 > end || depth < 0)
+				goto fail;
+
+			u32 len = be32(p);
+			u32 nameoff = be32(p + 4);
+			uintptr val = p + 8;
+			uintptr name = strings + nameoff;
+			struct fdt_level *node = &stack[depth];
+
+			p = (val + len + 3) & ~3UL;
+			if (p > end || nameoff >= size_strings)
+				goto fail;
+
+			if (str_eq(name, "#address-cells") && len == 4)
+				node->addr_cells = be32(val);
+			else if (str_eq(name, "#size-cells") && len == 4)
+				node->size_cells = be32(val);
+			else if (str_eq(name, "reg") && depth > 0
+				 && (node->ctx == CTX_MEMORY || node->ctx == CTX_RESERVED_CHILD))
+				parse_reg(val, len, &stack[depth - 1], node->ctx == CTX_RESERVED_CHILD);
+			else if (str_eq(name, "ranges") && node->ctx == CTX_SOC) {
+				soc_ranges = val;
+				soc_ranges_len = len;
+			} else if (str_eq(name, "model") && node->ctx == CTX_ROOT) {
+				for (u32 i = 0; i < len && i < BOOT_MODEL_LEN - 1; i++)
+					boot_info.model[i] = byte(val + i);
+			}
+			break;
+		}
+
+		case FDT_NOP:
+			break;
+
+		case FDT_END:
+			goto done;
+
+		default:
+			goto fail;
+		}
+	}
+	goto fail;
+
+done:
+	boot_info.valid = TRUE;
+	goto out;
+
+fail:
+	/* No half-parsed tree: the built-in layout, as if there were none. Byte
+	 * stores, since memset()'s unaligned tail stores fault with the MMU off.
+	 */
+	for (volatile char *b = (volatile char *) &boot_info; b < (volatile char *) (&boot_info + 1); b++)
+		*b = 0;
+	boot_info.dtb_phys = dtb_phys; // still worth reporting
+
+out:
+	/* written around the (off) caches; don't let a stale line shadow it */
+	for (uintptr line = (uintptr) &boot_info; line < (uintptr) (&boot_info + 1); line += 64)
+		asm volatile ("dc ivac, %0" :: "r" (line & ~63UL) : "memory");
+	asm volatile ("dsb sy" ::: "memory");
+}
+
+static BOOL overlaps(const struct mem_range *a, const struct mem_range *b)
+{
+	return a->base < b->base + b->size && b->base < a->base + a->size;
+}
+
+/* The reserved ranges may overlap each other (a /memreserve/ repeated under
+ * /reserved-memory, say), so take away their union, not their sum.
+ */
+u64 boot_mem_usable(void)
+{
+	u64 total = 0;
+
+	for (unsigned i = 0; i < boot_info.nr_mem; i++) {
+		const struct mem_range *m = &boot_info.mem[i];
+		struct mem_range clip[BOOT_MAX_RESERVED];
+		unsigned n = 0;
+
+		/* the reserved parts of `m', sorted by base */
+		for (unsigned j = 0; j < boot_info.nr_reserved; j++) {
+			const struct mem_range *r = &boot_info.reserved[j];
+			if (!overlaps(m, r))
+				continue;
+
+			u64 lo = r->base > m->base ? r->base : m->base;
+			u64 hi = r->base + r->size < m->base + m->size ? r->base + r->size : m->base + m->size;
+			unsigned k = n++;
+			for (; k > 0 && clip[k - 1].base > lo; k--)
+				clip[k] = clip[k - 1];
+			clip[k] = (struct mem_range) { .base = lo, .size = hi - lo };
+		}
+
+		/* everything in `m' past `end' is still uncounted */
+		u64 end = m->base;
+		for (unsigned k = 0; k < n; k++) {
+			if (clip[k].base > end)
+				total += clip[k].base - end;
+			if (clip[k].base + clip[k].size > end)
+				end = clip[k].base + clip[k].size;
+		}
+		total += m->base + m->size - end;
+	}
+	return total;
+}
+
+void boot_info_dump(void)
+{
+	if (!boot_info.valid) {
+		printk("no device tree (x0 = %lx), using the built-in layout\r\n", boot_info.dtb_phys);
+		return;
+	}
+
+	printk("device tree at 0x%lx (%u bytes): %s, %u cpus\r\n", boot_info.dtb_phys,
+	       boot_info.dtb_size, boot_info.model, boot_info.nr_cpus);
+	for (unsigned i = 0; i < boot_info.nr_mem; i++)
+		printk("  memory   0x%09lx-0x%09lx\r\n", boot_info.mem[i].base,
+		       boot_info.mem[i].base + boot_info.mem[i].size);
+	for (unsigned i = 0; i < boot_info.nr_reserved; i++)
+		printk("  reserved 0x%09lx-0x%09lx\r\n", boot_info.reserved[i].base,
+		       boot_info.reserved[i].base + boot_info.reserved[i].size);
+	printk("  %lu MB usable%s; peripherals at 0x%lx\r\n", boot_mem_usable() / MEGABYTE,
+	       boot_info.truncated ? " (ranges truncated)" : "", boot_info.mmio_base);
+
+	if (boot_info.mmio_base && boot_info.mmio_base != MMIO_BASE)
+		printk("  WARNING: built for peripherals at 0x%lx\r\n", MMIO_BASE);
+}
@@ -0,0 +1,126 @@
+/*
+ * firmware.c - what the VideoCore firmware knows about the board
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "firmware.h"
+#include "peripherals/mailbox.h"
+#include "printk.h"
+#include "util/utils.h"
+
+struct firmware_info firmware_info;
+
+/* Copies up to `n' response words of tag `handle' into `dst' */
+static void get_words(const struct mbox_msg *m, int handle, u32 *dst, unsigned n)
+{
+	unsigned nbytes;
+	const u32 *v = mbox_msg_value(m, handle, &nbytes);
+
+	for (unsigned i = 0; v && i < n && i < nbytes / sizeof(u32); i++)
+		dst[i] = v[i];
+}
+
+/* Second word of a (id, value) response */
+static void get_value(const struct mbox_msg *m, int handle, u32 *dst)
+{
+	u32 v[2] = { 0, 0 };
+
+	get_words(m, handle, v, 2);
+	*dst = v[1];
+}
+
+int firmware_info_fetch(void)
+{
+	static const u32 arm = MBOX_CLOCK_ARM, core = MBOX_CLOCK_CORE, sensor = 0;
+	struct firmware_info *fi = &firmware_info;
+	struct mbox_msg m;
+	u32 words[2];
+	unsigned nbytes;
+	const u32 *mac;
+
+	mbox_msg_init(&m);
+	int rev = mbox_msg_add(&m, MBOX_TAG_GET_FIRMWARE_REVISION, NULL, 0, 1);
+	int model = mbox_msg_add(&m, MBOX_TAG_GET_BOARD_MODEL, NULL, 0, 1);
+	int board_rev = mbox_msg_add(&m, MBOX_TAG_GET_BOARD_REVISION, NULL, 0, 1);
+	int mac_h = mbox_msg_add(&m, MBOX_TAG_GET_BOARD_MAC, NULL, 0, 2);
+	int serial = mbox_msg_add(&m, MBOX_TAG_GET_BOARD_SERIAL, NULL, 0, 2);
+	int arm_mem = mbox_msg_add(&m, MBOX_TAG_GET_ARM_MEMORY, NULL, 0, 2);
+	int vc_mem = mbox_msg_add(&m, MBOX_TAG_GET_VC_MEMORY, NULL, 0, 2);
+	int arm_clk = mbox_msg_add(&m, MBOX_TAG_GET_CLOCK_RATE, &arm, 1, 2);
+	int arm_min = mbox_msg_add(&m, MBOX_TAG_GET_MIN_CLOCK_RATE, &arm, 1, 2);
+	int arm_max = mbox_msg_add(&m, MBOX_TAG_GET_MAX_CLOCK_RATE, &arm, 1, 2);
+	int core_clk = mbox_msg_add(&m, MBOX_TAG_GET_CLOCK_RATE, &core, 1, 2);
+	int temp = mbox_msg_add(&m, MBOX_TAG_GET_TEMPERATURE, &sensor, 1, 2);
+	int temp_max = mbox_msg_add(&m, MBOX_TAG_GET_MAX_TEMPERATURE, &sensor, 1, 2);
+
+	memset(fi, 0, sizeof(*fi));
+	if (mbox_msg_send(&m) < 0)
+		return -1;
+
+	get_words(&m, rev, &fi->revision, 1);
+	get_words(&m, model, &fi->board_model, 1);
+	get_words(&m, board_rev, &fi->board_revision, 1);
+
+	if ((mac = mbox_msg_value(&m, mac_h, &nbytes)) && nbytes >= sizeof(fi->mac))
+		memcpy(fi->mac, mac, sizeof(fi->mac));
+
+	words[0] = words[1] = 0;
+	get_words(&m, serial, words, 2);
+	fi->board_serial = (u64) words[1] << 32 | words[0];
+
+	words[0] = words[1] = 0;
+	get_words(&m, arm_mem, words, 2);
+	fi->arm_mem_base = words[0];
+	fi->arm_mem_size = words[1];
+
+	words[0] = words[1] = 0;
+	get_words(&m, vc_mem, words, 2);
+	fi->vc_mem_base = words[0];
+	fi->vc_mem_size = words[1];
+
+	get_value(&m, arm_clk, &fi->arm_clock);
+	get_value(&m, arm_min, &fi->arm_clock_min);
+	get_value(&m, arm_max, &fi->arm_clock_max);
+	get_value(&m, core_clk, &fi->core_clock);
+	get_value(&m, temp, &fi->temp);
+	get_value(&m, temp_max, &fi->temp_max);
+
+	fi->valid = TRUE;
+	return 0;
+}
+
+void firmware_info_dump(void)
+{
+	struct firmware_info *fi = &firmware_info;
+
+	if (!fi->valid) {
+		printk("firmware: no answer\r\n");
+		return;
+	}
+
+	printk("firmware rev 0x%x, board model 0x%x rev 0x%x, serial %016lx\r\n",
+	       fi->revision, fi->board_model, fi->board_revision, fi->board_serial);
+	printk("  MAC %02x:%02x:%02x:%02x:%02x:%02x\r\n", fi->mac[0], fi->mac[1], fi->mac[2],
+	       fi->mac[3], fi->mac[4], fi->mac[5]);
+	printk("  ARM memory 0x%x+0x%x, VC memory 0x%x+0x%x\r\n", fi->arm_mem_base,
+	       fi->arm_mem_size, fi->vc_mem_base, fi->vc_mem_size);
+	printk("  ARM %u MHz (%u-%u), core %u MHz, %u.%u C (max %u.%u)\r\n",
+	       fi->arm_clock / 1000000, fi->arm_clock_min / 1000000, fi->arm_clock_max / 1000000,
+	       fi->core_clock / 1000000, fi->temp / 1000, fi->temp % 1000 / 100,
+	       fi->temp_max / 1000, fi->temp_max % 1000 / 100);
+}
@@ -0,0 +1,201 @@
+/*
+ * hrtimer.c - high-resolution one-shot timers
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hrtimer.h"
+#include "arch_timer.h"
+#include "atomic.h"
+#include "spinlock.h"
+#include "percpu.h"
+#include "util/utils.h"
+
+/* Only the owning core ever programs its (banked) timer from the list; other
+ * cores may cancel out of it, which at worst leaves a spurious wakeup behind.
+ */
+struct hrtimer_base {
+	spinlock_t lock;
+	struct hrtimer *head;
+};
+
+static DEFINE_PER_CPU(struct hrtimer_base, hrtimer_bases);
+
+static inline struct hrtimer_base *this_hrtimer_base(void)
+{
+	return this_cpu_ptr(&hrtimer_bases);
+}
+
+/* Locks whichever base `timer' is on, chasing it if it moves under us */
+static struct hrtimer_base *lock_hrtimer_base(struct hrtimer *timer, u64 *flags)
+{
+	*flags = irq_save();
+
+	for (;;) {
+		struct hrtimer_base *base = smp_load_acquire(&timer->base);
+
+		spin_lock(&base->lock);
+		if (base == timer->base)
+			return base;
+		spin_unlock(&base->lock);
+	}
+}
+
+/* Called with the local base locked */
+static void hrtimer_program(struct hrtimer_base *base)
+{
+	if (base->head)
+		arch_timer_set_next_event(arch_ns_to_ticks(base->head->expires));
+	else
+		arch_timer_stop();
+}
+
+static void hrtimer_enqueue(struct hrtimer_base *base, struct hrtimer *timer)
+{
+	struct hrtimer **pp = &base->head;
+
+	/* equal deadlines fire in the order they were started */
+	while (*pp && (*pp)->expires <= timer->expires)
+		pp = &(*pp)->next;
+
+	timer->next = *pp;
+	*pp = timer;
+	timer->queued = TRUE;
+}
+
+static void hrtimer_dequeue(struct hrtimer_base *base, struct hrtimer *timer)
+{
+	struct hrtimer **pp = &base->head;
+
+	while (*pp && *pp != timer)
+		pp = &(*pp)->next;
+
+	if (*pp)
+		*pp = timer->next;
+	timer->next = NULL;
+	timer->queued = FALSE;
+}
+
+void hrtimer_init(struct hrtimer *timer, hrtimer_fn_t function)
+{
+	timer->next = NULL;
+	timer->expires = 0;
+	timer->function = function;
+	timer->base = this_hrtimer_base();
+	timer->queued = FALSE;
+}
+
+/* Always (re)queues on the calling core, so that it's our own timer that needs
+ * reprogramming; the old base is left alone.
+ */
+void hrtimer_start(struct hrtimer *timer, u64 expires)
+{
+	u64 daif;
+	struct hrtimer_base *base = lock_hrtimer_base(timer, &daif);
+	struct hrtimer_base *local = this_hrtimer_base();
+
+	if (timer->queued)
+		hrtimer_dequeue(base, timer);
+
+	if (base != local) {
+		spin_unlock(&base->lock);
+		spin_lock(&local->lock);
+		smp_store_release(&timer->base, local);
+	}
+
+	struct hrtimer *first = local->head;
+	timer->expires = expires;
+	hrtimer_enqueue(local, timer);
+
+	if (local->head != first)
+		hrtimer_program(local);
+
+	spin_unlock_irqrestore(&local->lock, daif);
+}
+
+BOOL hrtimer_cancel(struct hrtimer *timer)
+{
+	u64 daif;
+	struct hrtimer_base *base = lock_hrtimer_base(timer, &daif);
+	BOOL was = timer->queued;
+
+	if (was) {
+		struct hrtimer *first = base->head;
+		hrtimer_dequeue(base, timer);
+		if (base->head != first && base == this_hrtimer_base())
+			hrtimer_program(base);
+	}
+
+	spin_unlock_irqrestore(&base->lock, daif);
+	return was;
+}
+
+u64 hrtimer_forward(struct hrtimer *timer, u64 now, u64 interval)
+{
+	u64 overruns;
+
+	if (timer->expires > now)
+		return 0;
+
+	overruns = (now - timer->expires) / interval + 1;
+	timer->expires += overruns * interval;
+	return overruns;
+}
+
+/* Clockevent handler. Callbacks are run with IRQs unmasked (as far as the
+ * timer's priority class allows) and the base unlocked, the list itself only
+ * ever touched with both.
+ */
+static void hrtimer_interrupt(void)
+{
+	struct hrtimer_base *base = this_hrtimer_base();
+	u64 daif = spin_lock_irqsave(&base->lock);
+	struct hrtimer *timer;
+
+	while ((timer = base->head) && timer->expires <= ktime_get_ns()) {
+		base->head = timer->next;
+		timer->next = NULL;
+		timer->queued = FALSE;
+
+		spin_unlock_irqrestore(&base->lock, daif);
+		enum hrtimer_restart restart = timer->function(timer);
+		daif = spin_lock_irqsave(&base->lock);
+
+		/* unless the callback already restarted (or moved) it itself */
+		if (restart == HRTIMER_RESTART && !timer->queued && timer->base == base)
+			hrtimer_enqueue(base, timer);
+	}
+
+	hrtimer_program(base);
+	spin_unlock_irqrestore(&base->lock, daif);
+}
+
+void hrtimers_init(void)
+{
+	for (unsigned core = 0; core < CORES; core++) {
+		struct hrtimer_base *base = per_cpu_ptr(&hrtimer_bases, core);
+
+		spin_lock_init(&base->lock);
+		base->head = NULL;
+	}
+	arch_timer_init(hrtimer_interrupt);
+}
+
+void hrtimers_init_secondary(void)
+{
+	arch_timer_init_secondary();
+}
@@ -0,0 +1,280 @@
+/*
+ * ipi.c - inter-processor interrupts
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ipi.h"
+#include "atomic.h"
+#include "exceptions.h"
+#include "mmio.h"
+#include "percpu.h"
+#include "peripherals/irqchip.h"
+#include "printk.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "util/utils.h"
+
+#define IPI_SGI                 0
+#define IPI_IRQ                 IRQ_SGI(IPI_SGI)
+
+/* Above the devices, below the timer: a shootdown or remote call shouldn't
+ * have to wait for some driver's handler to finish.
+ */
+#define IPI_PRIO                0x60
+
+/* smp_call_function_many() queues one of these, on its own stack, for each
+ * target; `left' is its count of targets still to finish.
+ */
+struct call_single {
+	struct call_single *next;
+	void (*func) (void *);
+	void *info;
+	volatile u32 *left;
+};
+
+struct ipi_cpu {
+	volatile u32 pending;                   // BIT(enum ipi_type)s not yet handled
+	struct call_single *volatile calls;     // newest first
+	volatile u64 tlb_requested;             // one per smp_tlb_flush_many() aimed at us
+	volatile u64 tlb_done;                  // `tlb_requested' as of our last flush
+
+	/* only ever touched by the owning core, with IRQs masked */
+	u64 sent[NR_IPIS];                      // requests we made of other cores
+	u64 raised;                             // interrupts those took
+	u64 interrupts;                         // interrupts we took
+	u64 handled[NR_IPIS];
+};
+
+static DEFINE_PER_CPU(struct ipi_cpu, ipi_cpu);
+
+static const char *const ipi_names[NR_IPIS] = {
+	[IPI_RESCHEDULE] = "resched",
+	[IPI_CALL_FUNC] = "call",
+	[IPI_TLB_FLUSH] = "tlb",
+	[IPI_SOFTIRQ] = "softirq",
+};
+
+/* Called with IRQs masked; a core that already has something pending isn't
+ * interrupted again.
+ */
+static void ipi_send_many(unsigned cpumask, enum ipi_type type)
+{
+	struct ipi_cpu *me = this_cpu_ptr(&ipi_cpu);
+	unsigned raise = 0;
+
+	for (unsigned cpu = 0; cpu < CORES; cpu++) {
+		if (!(cpumask & BIT(cpu)))
+			continue;
+
+		me->sent[type]++;
+		if (!atomic_fetch_or(&per_cpu(ipi_cpu, cpu).pending, BIT(type)))
+			raise |= BIT(cpu);
+	}
+
+	if (raise) {
+		me->raised += __builtin_popcount(raise);
+		irqchip_send_sgi(IPI_SGI, raise);
+	}
+}
+
+void smp_send_reschedule(unsigned cpu)
+{
+	u64 daif = irq_save();
+	ipi_send_many(BIT(cpu), IPI_RESCHEDULE);
+	irq_restore(daif);
+}
+
+void smp_send_softirq(void)
+{
+	u64 daif = irq_save();
+	ipi_send_many(BIT(smp_processor_id()), IPI_SOFTIRQ);
+	irq_restore(daif);
+}
+
+static void ipi_call_func(struct ipi_cpu *ic)
+{
+	struct call_single *c = xchg(&ic->calls, NULL), *fifo = NULL;
+
+	/* back into the order they were queued in */
+	while (c) {
+		struct call_single *next = c->next;
+		c->next = fifo;
+		fifo = c;
+		c = next;
+	}
+
+	while (fifo) {
+		/* the caller may be gone (and its stack reused) once we've counted down */
+		struct call_single *next = fifo->next;
+
+		fifo->func(fifo->info);
+		atomic_dec(fifo->left);
+		fifo = next;
+	}
+}
+
+void smp_call_function_many(unsigned cpumask, void (*func) (void *), void *info)
+{
+	struct call_single calls[CORES];
+	volatile u32 left;
+	u64 daif = irq_save();
+	unsigned self = smp_processor_id();
+	unsigned targets;
+
+	cpumask &= cpu_online_mask;
+	targets = cpumask & ~BIT(self);
+	left = __builtin_popcount(targets);
+
+	for (unsigned cpu = 0; cpu < CORES; cpu++) {
+		if (!(targets & BIT(cpu)))
+			continue;
+
+		struct ipi_cpu *ic = per_cpu_ptr(&ipi_cpu, cpu);
+		struct call_single *c = &calls[cpu], *head;
+
+		c->func = func;
+		c->info = info;
+		c->left = &left;
+		do {
+			head = READ_ONCE(ic->calls);
+			c->next = head;
+		} while (cmpxchg(&ic->calls, head, c) != head);
+	}
+	ipi_send_many(targets, IPI_CALL_FUNC);
+
+	if (cpumask & BIT(self))
+		func(info);
+	irq_restore(daif);
+
+	for (u32 n; (n = smp_load_acquire(&left)) != 0; )
+		__wfe_wait_ne32(&left, n);
+}
+
+void smp_call_function(void (*func) (void *), void *info)
+{
+	u64 daif = irq_save();
+	unsigned others = cpu_online_mask & ~BIT(smp_processor_id());
+	irq_restore(daif);
+
+	smp_call_function_many(others, func, info);
+}
+
+static inline void local_flush_tlb_all(void)
+{
+	asm volatile ("tlbi vmalle1\n\tdsb nsh\n\tisb" ::: "memory");
+}
+
+/* Whoever bumped `tlb_requested' up to what we read did so after changing
+ * their page tables, so one flush from here on covers all of them.
+ */
+static void ipi_tlb_flush(struct ipi_cpu *ic)
+{
+	u64 req = smp_load_acquire(&ic->tlb_requested);
+
+	local_flush_tlb_all();
+	smp_store_release(&ic->tlb_done, req);
+}
+
+void smp_tlb_flush_many(unsigned cpumask)
+{
+	u64 want[CORES];
+	unsigned targets;
+
+	/* the table walkers on the other cores have to see our updates */
+	asm volatile ("dsb ishst" ::: "memory");
+
+	u64 daif = irq_save();
+	cpumask &= cpu_online_mask;
+	targets = cpumask & ~BIT(smp_processor_id());
+
+	for (unsigned cpu = 0; cpu < CORES; cpu++)
+		if (targets & BIT(cpu))
+			want[cpu] = atomic_fetch_add(&per_cpu(ipi_cpu, cpu).tlb_requested, 1) + 1;
+	ipi_send_many(targets, IPI_TLB_FLUSH);
+
+	if (cpumask != targets)
+		local_flush_tlb_all();
+	irq_restore(daif);
+
+	for (unsigned cpu = 0; cpu < CORES; cpu++) {
+		if (!(targets & BIT(cpu)))
+			continue;
+
+		volatile u64 *done = &per_cpu(ipi_cpu, cpu).tlb_done;
+		for (u64 d; (d = smp_load_acquire(done)) < want[cpu]; )
+			__wfe_wait_ne64(done, d);
+	}
+}
+
+/* Whatever is pending is taken in one go: requests that come in after the
+ * swap raise the interrupt again.
+ */
+static void ipi_handler(void *arg)
+{
+	struct ipi_cpu *ic = this_cpu_ptr(&ipi_cpu);
+	u32 pending;
+
+	(void) arg;
+
+	irqchip_clear_sgis();
+	pending = xchg(&ic->pending, 0);
+	ic->interrupts++;
+
+	for (u32 p = pending; p; p &= p - 1)
+		ic->handled[__builtin_ctz(p)]++;
+
+	if (pending & BIT(IPI_RESCHEDULE))
+		irq_set_need_resched();
+	if (pending & BIT(IPI_CALL_FUNC))
+		ipi_call_func(ic);
+	if (pending & BIT(IPI_TLB_FLUSH))
+		ipi_tlb_flush(ic);
+}
+
+void ipi_init(void)
+{
+	request_irq(IPI_IRQ, ipi_handler, NULL);
+	irq_set_priority(IPI_IRQ, IPI_PRIO);
+}
+
+/* The handler is already registered; this core's own enable and priority are all that's left */
+void ipi_init_secondary(void)
+{
+	irqchip_set_priority(IPI_IRQ, IPI_PRIO);
+	irqchip_unmask(IPI_IRQ);
+}
+
+void ipi_stats_dump(void)
+{
+	for (unsigned cpu = 0; cpu < CORES; cpu++) {
+		struct ipi_cpu *ic = per_cpu_ptr(&ipi_cpu, cpu);
+		u64 sent = 0;
+
+		if (!(cpu_online_mask & BIT(cpu)))
+			continue;
+
+		for (unsigned type = 0; type < NR_IPIS; type++)
+			sent += ic->sent[type];
+
+		printk("core %u: sent %lu requests in %lu IPIs; took %lu IPIs for", cpu, sent,
+		       ic->raised, ic->interrupts);
+		for (unsigned type = 0; type < NR_IPIS; type++)
+			printk(" %lu %s", ic->handled[type], ipi_names[type]);
+		printk("\r\n");
+	}
+}
@@ -0,0 +1,185 @@
+/*
+ * irqstat.c - interrupt latency histograms
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "irqstat.h"
+#include "arch_timer.h"
+#include "mmio.h"
+#include "printk.h"
+#include "smp.h"
+#include "util/utils.h"
+
+struct irq_hist {
+	u32 entry[IRQSTAT_BUCKETS];     // stub entry -> handler dispatch
+	u32 handler[IRQSTAT_BUCKETS];   // handler duration
+	u64 count;                      // handler samples
+	u64 entries;                    // entry samples (first IRQ of an exception only)
+	u64 max_entry;
+	u64 max_handler;
+};
+
+/* Every core records into its own copy, from IRQ context with IRQs masked, so
+ * the counters need no atomics; only irqstat_dump() looks at the others'.
+ * Indexed rather than DEFINE_PER_CPU() to keep ~40K of zeros (on the GIC's 256
+ * lines) out of the per-CPU template in the image.
+ */
+struct irqstat_cpu {
+	struct irq_hist irq[IRQ_LINES];
+	u32 exit_hist[IRQSTAT_BUCKETS]; // stub entry -> eret, whole exception
+	u64 exit_count;
+} __attribute__((aligned(64)));
+
+volatile BOOL irqstat_enabled = FALSE;
+
+static struct irqstat_cpu irqstat_cpus[CORES];
+
+static inline unsigned bucket(u64 ticks)
+{
+	unsigned b = 63 - __builtin_clzll(ticks | 1);
+	return b < IRQSTAT_BUCKETS ? b : IRQSTAT_BUCKETS - 1;
+}
+
+void irqstat_init_cpu(void)
+{
+#ifdef IRQSTAT_CYCLES
+	u64 pmcr;
+
+	asm volatile ("mrs %0, pmcr_el0" : "=r" (pmcr));
+	asm volatile ("msr pmccfiltr_el0, xzr\n\t"      // count at EL1 (and EL0)
+		      "msr pmcntenset_el0, %0\n\t"      // C: the cycle counter
+		      "msr pmcr_el0, %1\n\t"
+		      "isb"
+		      :: "r" (1UL << 31), "r" (pmcr | BIT(6) | BIT(0))); // LC: 64 bits, E: enable
+#endif
+}
+
+void irqstat_enable(BOOL enable)
+{
+	irqstat_enabled = enable;
+}
+
+/* A core that was already past its irqstat_enabled check may still add a
+ * sample or two to the fresh counters.
+ */
+void irqstat_reset(void)
+{
+	BOOL was = irqstat_enabled;
+
+	irqstat_enabled = FALSE;
+	memset(irqstat_cpus, 0, sizeof(irqstat_cpus));
+	irqstat_enabled = was;
+}
+
+void irqstat_record(unsigned irq, BOOL first, u64 entry, u64 dispatch, u64 done)
+{
+	if (irq >= IRQ_LINES)
+		return;
+
+	struct irq_hist *h = &irqstat_cpus[smp_processor_id()].irq[irq];
+	u64 dur = done - dispatch;
+
+	if (first) {
+		u64 lat = dispatch - entry;
+
+		h->entry[bucket(lat)]++;
+		h->entries++;
+		if (lat > h->max_entry)
+			h->max_entry = lat;
+	}
+	h->handler[bucket(dur)]++;
+	h->count++;
+	if (dur > h->max_handler)
+		h->max_handler = dur;
+}
+
+void irqstat_record_exit(u64 entry, u64 exit)
+{
+	struct irqstat_cpu *sc = &irqstat_cpus[smp_processor_id()];
+
+	sc->exit_hist[bucket(exit - entry)]++;
+	sc->exit_count++;
+}
+
+static void dump_hist(const char *name, const u32 *hist)
+{
+	printk("  %-8s", name);
+	for (unsigned i = 0; i < IRQSTAT_BUCKETS; i++)
+		printk(" %6u", hist[i]);
+	printk("\r\n");
+}
+
+#ifdef IRQSTAT_CYCLES
+#define stat_to_ns(t)   (t) // "ns" below are cycles
+#else
+#define stat_to_ns(t)   arch_ticks_to_ns(t)
+#endif
+
+/* All cores' samples, summed */
+void irqstat_dump(void)
+{
+	struct irq_hist sum;
+	u32 exit_hist[IRQSTAT_BUCKETS] = {0};
+	u64 exit_count = 0;
+
+#ifdef IRQSTAT_CYCLES
+	printk("IRQ latency, log2 buckets of CPU cycles (bucket i: [2^i, 2^(i+1)) cycles)\r\n");
+#else
+	u64 ns_per_100 = arch_ticks_to_ns(100);
+
+	printk("IRQ latency, log2 buckets of %lu.%02lu ns counter ticks (bucket i: [2^i, 2^(i+1)) ticks)\r\n",
+	       ns_per_100 / 100, ns_per_100 % 100);
+#endif
+	printk("  %-8s", "bucket");
+	for (unsigned i = 0; i < IRQSTAT_BUCKETS; i++)
+		printk(" %6u", i);
+	printk("\r\n");
+
+	for (unsigned irq = 0; irq < IRQ_LINES; irq++) {
+		memset(&sum, 0, sizeof(sum));
+		for (unsigned cpu = 0; cpu < CORES; cpu++) {
+			const struct irq_hist *h = &irqstat_cpus[cpu].irq[irq];
+
+			for (unsigned i = 0; i < IRQSTAT_BUCKETS; i++) {
+				sum.entry[i] += h->entry[i];
+				sum.handler[i] += h->handler[i];
+			}
+			sum.count += h->count;
+			sum.entries += h->entries;
+			if (h->max_entry > sum.max_entry)
+				sum.max_entry = h->max_entry;
+			if (h->max_handler > sum.max_handler)
+				sum.max_handler = h->max_handler;
+		}
+		if (!sum.count)
+			continue;
+
+		printk("IRQ %u: %lu samples (%lu first in their exception), max entry %lu ns, max handler %lu ns\r\n",
+		       irq, sum.count, sum.entries, stat_to_ns(sum.max_entry), stat_to_ns(sum.max_handler));
+		dump_hist("entry", sum.entry);
+		dump_hist("handler", sum.handler);
+	}
+
+	for (unsigned cpu = 0; cpu < CORES; cpu++) {
+		for (unsigned i = 0; i < IRQSTAT_BUCKETS; i++)
+			exit_hist[i] += irqstat_cpus[cpu].exit_hist[i];
+		exit_count += irqstat_cpus[cpu].exit_count;
+	}
+	printk("total (stub entry to eret): %lu exceptions\r\n", exit_count);
+	dump_hist("total", exit_hist);
+}
@@ -26,7 +26,22 @@
 #include "kmalloc.h"
 #include "util/utils.h"
 #include "peripherals/uart0.h"
-#include "peripherals/mini_uart.h"
+#include "peripherals/irqchip.h"
+#include "exceptions.h"
+#include "irqstat.h"
+#include "softirq.h"
+#include "hrtimer.h"
+#include "timer_wheel.h"
+#include "sched.h"
+#include "smp.h"
+#include "cpufreq.h"
+#include "firmware.h"
+#include "fdt.h"
+#include "peripherals/mailbox.h"
+#include "ipi.h"
+#include "rcu.h"
+#include "kstats.h"
+#include "percpu.h"
 #include "util/memorymap.h"
 #include "vm_kernel.h"
 
@@ -46,16 +61,18 @@ static void SystemReboot(void)
 
 static void irq_init()
 {
-	vmmio_write32(ARM_IC_FIQ_CONTROL, 0); // completely disable FIQ's -- Linux does not use them so neither will we
-	vmmio_write32(ARM_IC_DISABLE_IRQS_1, -1);
-	vmmio_write32(ARM_IC_DISABLE_IRQS_2, -1);
-	vmmio_write32(ARM_IC_DISABLE_BASIC_IRQS, -1);
-	vmmio_write32(ARM_LOCAL_TIMER_INT_CONTROL0, 0);
-
-//	mmio_write32(ARM_IC_ENABLE_IRQS_1, ARM_IRQ_TIMER1);
-	vmmio_write32(ARM_IC_ENABLE_IRQS_2, ARM_IRQ_UART);
-
-	enable_irq();
+	irqchip_init();
+	irqstat_init_cpu();
+	softirq_init();
+	rcu_init();
+	hrtimers_init();
+	timer_wheel_init();
+	ipi_init();
+	mbox_init();
+
+	/* individual lines get unmasked by request_irq(); the CPU itself only
+	 * takes them once kernel_main() has a scheduler for irq_exit()
+	 */
 }
 
 /* Initialize libraries, software layer stuff. Don't put driver code in here! */
@@ -70,14 +87,21 @@ extern void *kern_img_end;
 
 _Noreturn void kernel_main(void)
 {
-	delay(1000);
-
-#ifdef DEBUG
-	muart_init(); // miniUART
-	muart_send_str("miniUART initialized\r\n");
-#endif
-	//uart0_init();
-	//irq_init();
+	percpu_init();
+	delay_init();
+	udelay(10);
+
+	/* Everything the IRQ path and the secondary cores' *_secondary() halves
+	 * rely on: the controller, softirqs, RCU, the clock (sched_init() needs
+	 * its conversion factors) and the timers. Then the console, which needs
+	 * the controller, and the scheduler, which irq_exit() and the RCU
+	 * quiescent-state check need, before IRQs go on.
+	 */
+	irq_init();
+	uart0_init(); // the console; printk() until now has only been buffered
+	sched_init();
+	enable_irq();
+	enable_fiq(); // nothing is routed to FIQ until request_fiq()
 
 	u64 el;
 	asm volatile ("\tmrs %0, CurrentEL\n"
@@ -93,10 +117,31 @@ _Noreturn void kernel_main(void)
 	       "image size: 0x%lx\r\n",
 	       start, &kern_img_end, (void *) &kern_img_end - (void *) start);
 
+	/* what the device tree _start was handed says about this board */
+	boot_info_dump();
+
+	/* everything we need from the firmware, in one round trip (with IRQs on,
+	 * the mailbox driver sleeps in WFE for the reply instead of polling)
+	 */
+	firmware_info_fetch();
+	firmware_info_dump();
+
 	init_stuff();
 
-	while (1) {
+	printk("%u cores online\r\n", smp_boot_secondaries());
+	/* its thread may land on any core; its limits come from firmware_info */
+	cpufreq_init();
+	kstats_init();
+#ifdef SCHED_BENCH
+	sched_bench();
+#endif
+#ifdef TIMER_WHEEL_BENCH
+	timer_wheel_bench();
+#endif
+#ifdef FIQ_BENCH
+	fiq_bench();
+#endif
 
-	}
+	sched_idle();
 }
 
@@ -0,0 +1,118 @@
+/*
+ * kstats.c - statistics on demand, from the console
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kstats.h"
+#include "atomic.h"
+#include "cpufreq.h"
+#include "drivers/console.h"
+#include "ipi.h"
+#include "irqstat.h"
+#include "peripherals/mailbox.h"
+#include "printk.h"
+#include "rcu.h"
+#include "sched.h"
+#include "softirq.h"
+#include "spinlock.h"
+#include "tlbflush.h"
+#include "util/utils.h"
+
+#define KSTATS_PRIO             (SCHED_PRIO_DEFAULT - 4)
+
+#define KSTATS_DUMP             BIT(0)
+#define KSTATS_IRQSTAT          BIT(1)
+#define KSTATS_RESET            BIT(2)
+
+static struct thread *kstats_thread;
+static volatile u32 kstats_pending;     // KSTATS_* requests not yet carried out
+
+void kstats_dump_all(void)
+{
+	irqstat_dump();
+	softirq_stats_dump();
+	ipi_stats_dump();
+	rcu_stats_dump();
+	tlb_stats_dump();
+	sched_stats_dump();
+	cpufreq_stats_dump();
+	mbox_stats_dump();
+	console_stats_dump();
+#ifdef LOCKSTAT
+	lockstat_dump();
+#endif
+}
+
+static void kstats_fn(void *arg)
+{
+	(void) arg;
+
+	for (;;) {
+		thread_block(); // a key pressed meanwhile makes this return at once
+		u32 todo = xchg(&kstats_pending, 0);
+
+		if (todo & KSTATS_IRQSTAT) {
+			irqstat_enable(!irqstat_enabled);
+			printk("IRQ statistics %s\r\n", irqstat_enabled ? "on" : "off");
+		}
+		if (todo & KSTATS_RESET) {
+			irqstat_reset();
+			printk("IRQ statistics cleared\r\n");
+		}
+		if (todo & KSTATS_DUMP)
+			kstats_dump_all();
+	}
+}
+
+BOOL kstats_key(char c)
+{
+	u32 todo;
+
+	switch (c) {
+	case KSTATS_KEY_DUMP:
+		todo = KSTATS_DUMP;
+		break;
+	case KSTATS_KEY_IRQSTAT:
+		todo = KSTATS_IRQSTAT;
+		break;
+	case KSTATS_KEY_RESET:
+		todo = KSTATS_RESET;
+		break;
+	default:
+		return FALSE;
+	}
+
+	struct thread *t = smp_load_acquire(&kstats_thread);
+	if (t) {
+		atomic_fetch_or(&kstats_pending, todo);
+		thread_wake(t);
+	}
+	return TRUE;
+}
+
+void kstats_init(void)
+{
+	struct thread *t = thread_create("kstats", kstats_fn, NULL, KSTATS_PRIO);
+
+	if (!t) {
+		printk("kstats: no thread slot\r\n");
+		return;
+	}
+	smp_store_release(&kstats_thread, t);
+	printk("^T dumps statistics, ^P turns IRQ statistics on/off, ^R clears them\r\n");
+}
@@ -0,0 +1,50 @@
+/*
+ * percpu.c - per-core data areas
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "percpu.h"
+
+/* linker.ld: the template, and room for CORES copies of it after .bss */
+extern char __per_cpu_start[], __per_cpu_end[], __per_cpu_areas[];
+
+uintptr __per_cpu_offset[CORES];
+
+static inline void set_my_cpu_offset(uintptr off)
+{
+	asm volatile ("msr tpidr_el1, %0" :: "r" (off) : "memory");
+}
+
+void percpu_init(void)
+{
+	size_t size = __per_cpu_end - __per_cpu_start;
+
+	for (unsigned core = 0; core < CORES; core++) {
+		char *area = __per_cpu_areas + core * size;
+
+		memcpy(area, __per_cpu_start, size);
+		__per_cpu_offset[core] = area - __per_cpu_start;
+	}
+
+	set_my_cpu_offset(__per_cpu_offset[0]);
+}
+
+void percpu_init_secondary(unsigned core)
+{
+	set_my_cpu_offset(__per_cpu_offset[core]);
+}
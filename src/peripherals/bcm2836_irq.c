@@ -0,0 +1,375 @@
+/*
+ * bcm2836_irq.c - BCM2835 interrupt controller + BCM2836 core-local interrupts
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "peripherals/irqchip.h"
+#include "atomic.h"
+#include "mmio.h"
+#include "util/utils.h"
+#include "smp.h"
+#include "percpu.h"
+#include "spinlock.h"
+
+#if RASPPI <= 3
+
+/* The core-local registers come in one copy per core, 4 bytes apart */
+#define LOCAL_REG(reg, core)    ((reg) + 4 * (core))
+
+static const unsigned pending_base[4] = {
+	ARM_IRQLOCAL_BASE, ARM_IRQ1_BASE, ARM_IRQ2_BASE, ARM_IRQBASIC_BASE,
+};
+
+/* This controller has no priorities of its own, so they're done in software:
+ * irqchip_ack() disables every line of the same or a less urgent class than the
+ * one it hands out, and the matching irqchip_eoi() puts them back. Lines are kept
+ * as bitmaps in the same register order as the pending registers.
+ */
+#define ACK_NESTED              (1U << 31) // irqchip_ack() raised the running class
+
+/* The local timer and mailbox lines can be turned off through their control
+ * registers; the rest of the local ones (PMU, AXI, local timer) can't, so they
+ * are always class 0 lest they keep firing while blocked.
+ */
+#define LOCAL_MASKABLE          0xFFU
+
+/* Per-core state; only ever touched by its own core, with IRQs masked.
+ * `pending' is a snapshot of the pending registers, consumed one bit at a time
+ * by irqchip_ack(). The GPU controller is cascaded into the core-local one, and
+ * the basic pending register tells us which of the other two GPU pending
+ * registers are worth reading.
+ */
+struct irq_cpu {
+	u32 pending[4];
+	u32 local_enabled;                              // what request_irq() turned on, register 0
+	const u32 *blocked;
+	u8 running_class[IRQ_PRIO_CLASSES];
+	unsigned running_depth;
+};
+
+static DEFINE_PER_CPU(struct irq_cpu, irq_cpu);
+
+/* The GPU lines are shared, and only ever blocked on the core they're routed to */
+static u32 gpu_enabled[4];                              // registers 1-3
+static unsigned gpu_core;
+static spinlock_t gpu_lock = SPINLOCK_INIT;
+
+static u8 line_class[IRQ_LINES];
+static u32 class_lines[IRQ_PRIO_CLASSES][4];            // lines of class >= c
+static const u32 no_lines[4];
+
+static const uintptr enable_reg[4] = {
+	0, ARM_IC_ENABLE_IRQS_1, ARM_IC_ENABLE_IRQS_2, ARM_IC_ENABLE_BASIC_IRQS,
+};
+static const uintptr disable_reg[4] = {
+	0, ARM_IC_DISABLE_IRQS_1, ARM_IC_DISABLE_IRQS_2, ARM_IC_DISABLE_BASIC_IRQS,
+};
+
+static inline struct irq_cpu *this_irq_cpu(void)
+{
+	return this_cpu_ptr(&irq_cpu);
+}
+
+static BOOL read_pending(unsigned core, struct irq_cpu *ic)
+{
+	u32 local = vmmio_read32(LOCAL_REG(ARM_LOCAL_IRQ_PENDING0, core));
+	u32 basic = 0, pend1 = 0, pend2 = 0;
+
+	if (local & ARM_LOCAL_PENDING_GPU) {
+		basic = vmmio_read32(ARM_IC_IRQ_BASIC_PENDING);
+		if (basic & (ARM_IC_BASIC_PENDING_1 | ARM_IC_BASIC_SHORTCUT_1))
+			pend1 = vmmio_read32(ARM_IC_IRQ_PENDING_1);
+		if (basic & (ARM_IC_BASIC_PENDING_2 | ARM_IC_BASIC_SHORTCUT_2))
+			pend2 = vmmio_read32(ARM_IC_IRQ_PENDING_2);
+		basic &= (1U << ARM_IRQS_BASIC_REG) - 1;
+	}
+
+	ic->pending[0] = local & ~ARM_LOCAL_PENDING_GPU & ((1U << ARM_IRQS_LOCAL_REG) - 1);
+	ic->pending[1] = pend1;
+	ic->pending[2] = pend2;
+	ic->pending[3] = basic;
+
+	return (ic->pending[0] | pend1 | pend2 | basic) != 0;
+}
+
+static inline unsigned line_reg(unsigned irq)
+{
+	if (irq < ARM_IRQ2_BASE)
+		return 1;
+	if (irq < ARM_IRQBASIC_BASE)
+		return 2;
+	if (irq < ARM_IRQLOCAL_BASE)
+		return 3;
+	return 0;
+}
+
+/* Brings the hardware enables of the lines in `lines' in line with what's enabled
+ * and not blocked: the calling core's own for the local lines, the GPU core's for
+ * the rest. Called with IRQs masked.
+ */
+static void hw_update(const u32 lines[4])
+{
+	unsigned core = smp_processor_id();
+
+	if (lines[1] | lines[2] | lines[3]) {
+		spin_lock(&gpu_lock);
+		const u32 *blocked = per_cpu(irq_cpu, gpu_core).blocked;
+
+		for (unsigned r = 1; r < 4; r++) {
+			u32 on = lines[r] & gpu_enabled[r] & ~blocked[r];
+			u32 off = lines[r] & ~on;
+
+			if (on)
+				vmmio_write32(enable_reg[r], on);
+			if (off)
+				vmmio_write32(disable_reg[r], off);
+		}
+		spin_unlock(&gpu_lock);
+	}
+
+	if (lines[0] & LOCAL_MASKABLE) {
+		struct irq_cpu *ic = this_irq_cpu();
+		u32 on = ic->local_enabled & ~ic->blocked[0];
+		uintptr timer_ctl = LOCAL_REG(ARM_LOCAL_TIMER_INT_CONTROL0, core);
+		uintptr mailbox_ctl = LOCAL_REG(ARM_LOCAL_MAILBOX_INT_CONTROL0, core);
+
+		// bits 0-3: timers, 4-7: mailboxes; the upper nibbles are the FIQ enables
+		vmmio_write32(timer_ctl, (vmmio_read32(timer_ctl) & ~0xFU) | (on & 0xF));
+		vmmio_write32(mailbox_ctl, (vmmio_read32(mailbox_ctl) & ~0xFU) | ((on >> 4) & 0xF));
+	}
+}
+
+static void update_class_lines(void)
+{
+	memset(class_lines, 0, sizeof(class_lines));
+
+	for (unsigned irq = 0; irq < IRQ_LINES; irq++) {
+		unsigned r = line_reg(irq);
+		u32 bit = 1U << (irq - pending_base[r]);
+
+		for (unsigned c = 1; c <= line_class[irq]; c++)
+			class_lines[c][r] |= bit;
+	}
+}
+
+static void irq_cpu_init(unsigned core)
+{
+	struct irq_cpu *ic = per_cpu_ptr(&irq_cpu, core);
+
+	memset(ic, 0, sizeof(*ic));
+	ic->blocked = no_lines;
+
+	vmmio_write32(LOCAL_REG(ARM_LOCAL_TIMER_INT_CONTROL0, core), 0);
+	vmmio_write32(LOCAL_REG(ARM_LOCAL_MAILBOX_INT_CONTROL0, core), 0);
+}
+
+void irqchip_init(void)
+{
+	vmmio_write32(ARM_IC_FIQ_CONTROL, 0); // no FIQ until someone asks for one with request_fiq()
+	vmmio_write32(ARM_IC_DISABLE_IRQS_1, -1);
+	vmmio_write32(ARM_IC_DISABLE_IRQS_2, -1);
+	vmmio_write32(ARM_IC_DISABLE_BASIC_IRQS, -1);
+
+	memset(gpu_enabled, 0, sizeof(gpu_enabled));
+	gpu_core = 0;
+	for (unsigned irq = 0; irq < IRQ_LINES; irq++)
+		line_class[irq] = irq >= ARM_IRQLOCAL_BASE && !(BIT(irq - ARM_IRQLOCAL_BASE) & LOCAL_MASKABLE)
+			? 0 : IRQ_PRIO_CLASS(IRQ_PRIO_DEFAULT);
+	update_class_lines();
+	irq_cpu_init(smp_processor_id());
+}
+
+/* Each core's local timer and mailbox lines are off until it turns them on itself */
+void irqchip_init_secondary(void)
+{
+	irq_cpu_init(smp_processor_id());
+}
+
+/* A local line is only turned on or off for the calling core */
+static void set_enabled(unsigned irq, BOOL on)
+{
+	u32 lines[4] = {0};
+	unsigned r = line_reg(irq);
+	u64 daif = irq_save();
+	u32 *enabled = r ? &gpu_enabled[r] : &this_irq_cpu()->local_enabled;
+
+	lines[r] = 1U << (irq - pending_base[r]);
+	if (on)
+		atomic_fetch_or(enabled, lines[r]);
+	else
+		atomic_fetch_andnot(enabled, lines[r]);
+
+	hw_update(lines);
+	irq_restore(daif);
+}
+
+/* everything on the local controller other than the timers and mailboxes is always routed */
+void irqchip_unmask(unsigned irq)
+{
+	if (irq < IRQ_LINES)
+		set_enabled(irq, TRUE);
+}
+
+void irqchip_mask(unsigned irq)
+{
+	if (irq < IRQ_LINES)
+		set_enabled(irq, FALSE);
+}
+
+/* Hands out the snapshot lowest IRQ number first (per register), and only goes back
+ * to the hardware once it's used up. There's no acknowledge on this controller: a
+ * line stays pending until its device is serviced. Anything in the snapshot that is
+ * blocked by the running class is left there for the level that blocked it.
+ */
+u32 irqchip_ack(void)
+{
+	unsigned core = smp_processor_id();
+	struct irq_cpu *ic = this_irq_cpu();
+	unsigned irq = IRQ_SPURIOUS;
+
+	for (unsigned pass = 0; pass < 2 && irq == IRQ_SPURIOUS; pass++) {
+		if (pass && !read_pending(core, ic))
+			break;
+
+		for (unsigned i = 0; i < 4; i++) {
+			u32 pend = ic->pending[i] & ~ic->blocked[i];
+			if (pend) {
+				ic->pending[i] &= ~(pend & -pend); // clear lowest set bit
+				irq = pending_base[i] + __builtin_ctz(pend);
+				break;
+			}
+		}
+	}
+
+	if (irq == IRQ_SPURIOUS)
+		return IRQ_SPURIOUS;
+
+	/* class 0 handlers run with IRQs masked, no need to block anything */
+	unsigned class = line_class[irq];
+	if (class == 0)
+		return irq;
+
+	ic->running_class[ic->running_depth++] = class;
+	ic->blocked = class_lines[class];
+	hw_update(ic->blocked);
+
+	return irq | ACK_NESTED;
+}
+
+void irqchip_eoi(u32 ack)
+{
+	if (!(ack & ACK_NESTED))
+		return;
+
+	struct irq_cpu *ic = this_irq_cpu();
+	const u32 *was = ic->blocked;
+	ic->running_depth--;
+	ic->blocked = ic->running_depth ? class_lines[ic->running_class[ic->running_depth - 1]] : no_lines;
+	hw_update(was);
+}
+
+/* Only takes effect for lines that aren't currently being handled */
+void irqchip_set_priority(unsigned irq, u8 prio)
+{
+	if (irq >= IRQ_LINES)
+		return;
+	if (irq >= ARM_IRQLOCAL_BASE && !(BIT(irq - ARM_IRQLOCAL_BASE) & LOCAL_MASKABLE))
+		return;
+
+	line_class[irq] = IRQ_PRIO_CLASS(prio);
+	update_class_lines();
+}
+
+/* A GPU line (< ARM_IRQLOCAL_BASE) goes through the legacy controller's single FIQ
+ * source select, cascaded to core 0 like the IRQs; the local timers and mailboxes
+ * each have an FIQ enable next to their IRQ one (bits 4-7), which takes precedence.
+ */
+int irqchip_route_fiq(unsigned irq)
+{
+	unsigned core = smp_processor_id();
+
+	irqchip_mask(irq);
+
+	if (irq < ARM_IRQLOCAL_BASE) {
+		vmmio_write32(ARM_LOCAL_GPU_INT_ROUTING,
+			      vmmio_read32(ARM_LOCAL_GPU_INT_ROUTING) & ~(3U << 2)); // FIQ -> core 0
+		vmmio_write32(ARM_IC_FIQ_CONTROL, ARM_IC_FIQ_ENABLE | irq);
+	} else if (irq <= ARM_IRQLOCAL0_CNTV) {
+		uintptr ctl = LOCAL_REG(ARM_LOCAL_TIMER_INT_CONTROL0, core);
+		vmmio_write32(ctl, vmmio_read32(ctl) | BIT(4 + irq - ARM_IRQLOCAL0_CNTPS));
+	} else if (irq <= ARM_IRQLOCAL0_MAILBOX3) {
+		uintptr ctl = LOCAL_REG(ARM_LOCAL_MAILBOX_INT_CONTROL0, core);
+		vmmio_write32(ctl, vmmio_read32(ctl) | BIT(4 + irq - ARM_IRQLOCAL0_MAILBOX0));
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+void irqchip_unroute_fiq(unsigned irq)
+{
+	unsigned core = smp_processor_id();
+
+	if (irq < ARM_IRQLOCAL_BASE) {
+		vmmio_write32(ARM_IC_FIQ_CONTROL, 0);
+	} else if (irq <= ARM_IRQLOCAL0_CNTV) {
+		uintptr ctl = LOCAL_REG(ARM_LOCAL_TIMER_INT_CONTROL0, core);
+		vmmio_write32(ctl, vmmio_read32(ctl) & ~BIT(4 + irq - ARM_IRQLOCAL0_CNTPS));
+	} else if (irq <= ARM_IRQLOCAL0_MAILBOX3) {
+		uintptr ctl = LOCAL_REG(ARM_LOCAL_MAILBOX_INT_CONTROL0, core);
+		vmmio_write32(ctl, vmmio_read32(ctl) & ~BIT(4 + irq - ARM_IRQLOCAL0_MAILBOX0));
+	}
+}
+
+/* The GPU interrupts can only be routed as a whole, to a single core, so the
+ * lowest core in `cpumask' gets all of them. The core-local ones stay put.
+ */
+void irqchip_set_affinity(unsigned irq, unsigned cpumask)
+{
+	if (irq >= ARM_IRQLOCAL_BASE || cpumask == 0)
+		return;
+
+	u64 daif = spin_lock_irqsave(&gpu_lock);
+	gpu_core = __builtin_ctz(cpumask) & (CORES - 1);
+	vmmio_write32(ARM_LOCAL_GPU_INT_ROUTING,
+		      (vmmio_read32(ARM_LOCAL_GPU_INT_ROUTING) & ~3U) | gpu_core);
+	spin_unlock_irqrestore(&gpu_lock, daif);
+}
+
+/* SGIs become bits in each target core's mailbox 0, which shows up on that core
+ * as ARM_IRQLOCAL0_MAILBOX0; the handler reads (and clears) them through
+ * ARM_LOCAL_MAILBOX0_CLRn.
+ */
+void irqchip_send_sgi(unsigned sgi, unsigned cpumask)
+{
+	asm volatile ("dsb ishst" ::: "memory"); // make our writes visible before the target core runs its handler
+	for (unsigned core = 0; core < 4; core++)
+		if (cpumask & BIT(core))
+			vmmio_write32(ARM_LOCAL_MAILBOX0_SET0 + 0x10 * core, BIT(sgi));
+}
+
+void irqchip_clear_sgis(void)
+{
+	uintptr clr = ARM_LOCAL_MAILBOX0_CLR0 + 0x10 * smp_processor_id();
+
+	vmmio_write32(clr, vmmio_read32(clr));
+	asm volatile ("dsb sy" ::: "memory"); // cleared before the caller looks for new requests
+}
+
+#endif // RASPPI <= 3
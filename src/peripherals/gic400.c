@@ -0,0 +1,148 @@
+/*
+ * gic400.c - GIC-400 interrupt controller driver (Raspberry Pi 4)
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "peripherals/irqchip.h"
+#include "peripherals/gic400.h"
+#include "mmio.h"
+#include "util/utils.h"
+
+#if RASPPI >= 4
+
+static unsigned gic_lines;
+
+static inline void gic_set_byte(uintptr reg0, unsigned irq, u8 val)
+{
+	uintptr reg = reg0 + (irq & ~3U);
+	unsigned shift = (irq & 3) * 8;
+
+	vmmio_write32(reg, (vmmio_read32(reg) & ~(0xFFU << shift)) | ((u32) val << shift));
+}
+
+/* Banked per core: SGIs, PPIs and the CPU interface itself */
+static void gic_init_cpu(void)
+{
+	vmmio_write32(GICD_ICENABLER0, -1);
+	vmmio_write32(GICD_ICPENDR0, -1);
+	vmmio_write32(GICD_ICACTIVER0, -1);
+	for (unsigned irq = 0; irq < GIC_SPI_BASE; irq += 4)
+		vmmio_write32(GICD_IPRIORITYR0 + irq, GIC_PRIO_DEFAULT * 0x01010101U);
+
+	vmmio_write32(GICC_PMR, GIC_PRIO_MASK_NONE);
+	vmmio_write32(GICC_BPR, 0); // all priority bits are group priority (needed for preemption)
+	vmmio_write32(GICC_CTLR, GICC_CTLR_ENABLE);
+}
+
+void irqchip_init(void)
+{
+	vmmio_write32(GICD_CTLR, 0);
+
+	gic_lines = GICD_TYPER_ITLINES(vmmio_read32(GICD_TYPER));
+	if (gic_lines > IRQ_LINES)
+		gic_lines = IRQ_LINES;
+
+	/* Shared interrupts: masked, level-triggered, default priority, core 0 */
+	for (unsigned irq = GIC_SPI_BASE; irq < gic_lines; irq += 32) {
+		vmmio_write32(GICD_ICENABLER0 + irq / 8, -1);
+		vmmio_write32(GICD_ICPENDR0 + irq / 8, -1);
+		vmmio_write32(GICD_ICACTIVER0 + irq / 8, -1);
+	}
+	for (unsigned irq = GIC_SPI_BASE; irq < gic_lines; irq += 4) {
+		vmmio_write32(GICD_IPRIORITYR0 + irq, GIC_PRIO_DEFAULT * 0x01010101U);
+		vmmio_write32(GICD_ITARGETSR0 + irq, 0x01010101U);
+	}
+	for (unsigned irq = GIC_SPI_BASE; irq < gic_lines; irq += 16)
+		vmmio_write32(GICD_ICFGR0 + irq / 4, 0);
+
+	vmmio_write32(GICD_CTLR, GICD_CTLR_ENABLE);
+
+	gic_init_cpu();
+}
+
+void irqchip_init_secondary(void)
+{
+	gic_init_cpu();
+}
+
+void irqchip_unmask(unsigned irq)
+{
+	vmmio_write32(GICD_ISENABLER0 + (irq / 32) * 4, BIT(irq % 32));
+}
+
+void irqchip_mask(unsigned irq)
+{
+	vmmio_write32(GICD_ICENABLER0 + (irq / 32) * 4, BIT(irq % 32));
+}
+
+/* Reading the IAR marks the interrupt active and raises the running priority,
+ * so only more urgent interrupts can get signalled until the matching EOI.
+ */
+u32 irqchip_ack(void)
+{
+	u32 iar = vmmio_read32(GICC_IAR);
+
+	if (GICC_IAR_INTID(iar) >= 1020) // 1020-1023 are special/spurious
+		return IRQ_SPURIOUS;
+
+	return iar;
+}
+
+void irqchip_eoi(u32 ack)
+{
+	vmmio_write32(GICC_EOIR, ack);
+}
+
+void irqchip_set_priority(unsigned irq, u8 prio)
+{
+	gic_set_byte(GICD_IPRIORITYR0, irq, prio & (0xF << GIC_PRIO_SHIFT));
+}
+
+/* FIQs come from group 0, which only the secure side can configure, and we are
+ * started non-secure by the firmware's armstub.
+ */
+int irqchip_route_fiq(unsigned irq)
+{
+	(void) irq;
+	return -1;
+}
+
+void irqchip_unroute_fiq(unsigned irq)
+{
+	(void) irq;
+}
+
+void irqchip_set_affinity(unsigned irq, unsigned cpumask)
+{
+	if (irq < GIC_SPI_BASE || cpumask == 0) // SGIs/PPIs are always private
+		return;
+
+	gic_set_byte(GICD_ITARGETSR0, irq, cpumask & 0xFF);
+}
+
+void irqchip_send_sgi(unsigned sgi, unsigned cpumask)
+{
+	asm volatile ("dsb ishst" ::: "memory"); // make our writes visible before the target core runs its handler
+	vmmio_write32(GICD_SGIR, GICD_SGIR_TARGETS(cpumask) | GICD_SGIR_SGIINTID(sgi));
+}
+
+void irqchip_clear_sgis(void)
+{
+}
+
+#endif // RASPPI >= 4
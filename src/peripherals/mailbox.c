@@ -0,0 +1,263 @@
+/*
+ * mailbox.c - VideoCore firmware property interface
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "peripherals/mailbox.h"
+#include "arch_timer.h"
+#include "atomic.h"
+#include "exceptions.h"
+#include "mmio.h"
+#include "printk.h"
+#include "spinlock.h"
+#include "vm_kernel.h"
+#include "util/utils.h"
+
+#define MBOX_CODE_REQUEST       0x00000000
+#define MBOX_CODE_RESPONSE_OK   0x80000000
+#define MBOX_TAG_RESPONSE       0x80000000      // in the tag's request/response word
+#define MBOX_TAG_END            0x00000000
+
+/* The firmware handles one message at a time anyway, so we only ever have
+ * one out: `busy' is owned by whoever sends it, and `inflight' is the word
+ * its reply will come back as. The IRQ handler and a poller may both be
+ * draining the FIFO; whichever sees the reply sets `done'.
+ *
+ * A message that times out stays in flight (`stale'): the firmware may
+ * still answer it, writing mbox_dma as it does, and its reply would look
+ * just like the next message's. Nothing more is sent until it's in.
+ */
+static struct {
+	volatile u32 busy;
+	volatile u32 inflight;
+	volatile BOOL done;
+	BOOL stale;
+	BOOL irq_ready;
+
+	u64 messages;
+	u64 tags;
+	u64 by_irq;                     // replies waited for with the IRQ
+	u64 polled;
+	u64 timeouts;
+	u64 irqs;                       // written by the handler only
+	u64 stray;                      // replies nobody was waiting for
+	u64 late;                       // replies to timed-out messages
+} mbox;
+
+/* The only memory the firmware is ever handed. Messages are copied in and
+ * out, so a late write from the firmware can't land on anybody's stack.
+ */
+static u32 mbox_dma[MBOX_MSG_WORDS] __attribute__((aligned(MBOX_MSG_ALIGN)));
+
+static void dcache_clean_inval(const void *start, size_t size)
+{
+	for (uintptr p = (uintptr) start; p < (uintptr) start + size; p += MBOX_MSG_ALIGN)
+		asm volatile ("dc civac, %0" :: "r" (p) : "memory");
+	asm volatile ("dsb sy" ::: "memory");
+}
+
+void mbox_msg_init(struct mbox_msg *m)
+{
+	m->len = 2; // size, request code
+	m->overflow = FALSE;
+}
+
+int mbox_msg_add(struct mbox_msg *m, u32 tag, const u32 *req, unsigned nreq, unsigned nresp)
+{
+	unsigned nval = nreq > nresp ? nreq : nresp;
+	int handle = m->len;
+
+	/* tag, value size, request code, value buffer, and the end tag after it all */
+	if (m->overflow || m->len + 3 + nval + 1 > MBOX_MSG_WORDS) {
+		m->overflow = TRUE;
+		return -1;
+	}
+
+	m->buf[m->len++] = tag;
+	m->buf[m->len++] = nval * sizeof(u32);
+	m->buf[m->len++] = 0;
+	for (unsigned i = 0; i < nval; i++)
+		m->buf[m->len++] = i < nreq ? req[i] : 0;
+
+	return handle;
+}
+
+const u32 *mbox_msg_value(const struct mbox_msg *m, int handle, unsigned *nbytes)
+{
+	if (handle < 0 || m->buf[1] != MBOX_CODE_RESPONSE_OK || !(m->buf[handle + 2] & MBOX_TAG_RESPONSE))
+		return NULL;
+
+	if (nbytes)
+		*nbytes = m->buf[handle + 2] & ~MBOX_TAG_RESPONSE;
+	return &m->buf[handle + 3];
+}
+
+/* Pops everything the firmware has sent back */
+static void mbox_drain(void)
+{
+	while (!(vmmio_read32(MAILBOX0_STATUS) & MAILBOX_STATUS_EMPTY)) {
+		u32 reply = vmmio_read32(MAILBOX0_READ);
+
+		if (reply == mbox.inflight && !mbox.done) {
+			smp_store_release(&mbox.done, TRUE);
+			asm volatile ("sev");
+		} else {
+			mbox.stray++;
+		}
+	}
+}
+
+static void mbox_irq_handler(void *arg)
+{
+	(void) arg;
+
+	mbox.irqs++;
+	mbox_drain();
+}
+
+/* Waits for the reply to `inflight'; the IRQ (or the event stream, for the
+ * timeout) gets us out of WFE. FALSE if the deadline passes first.
+ */
+static BOOL mbox_wait(BOOL use_irq, u64 deadline)
+{
+	while (!smp_load_acquire(&mbox.done)) {
+		if (use_irq) {
+			asm volatile ("wfe");
+		} else {
+			u64 daif = irq_save();
+			mbox_drain();
+			irq_restore(daif);
+		}
+
+		if (!mbox.done && arch_counter_read() > deadline)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int mbox_call(unsigned chan, u32 *buf, size_t size)
+{
+	u64 deadline = arch_counter_read() + arch_ns_to_ticks(MBOX_TIMEOUT_US * NSEC_PER_USEC);
+	u64 daif = irq_save();
+	BOOL use_irq = mbox.irq_ready && !in_interrupt() && !(daif & BIT(7));
+	uintptr phys = virt_to_phys(mbox_dma);
+	int ret = 0;
+
+	irq_restore(daif);
+	if (!phys || phys >= GIGABYTE || size > sizeof(mbox_dma))
+		return -1;
+
+	for (u32 b; (b = xchg(&mbox.busy, 1)) != 0; ) {
+		if (arch_counter_read() > deadline)
+			return -1;
+		__wfe_wait_ne32(&mbox.busy, b);
+	}
+
+	if (mbox.stale) {
+		if (!mbox_wait(use_irq, deadline)) {
+			ret = -1;
+			goto out;
+		}
+		mbox.stale = FALSE;
+		mbox.late++;
+	}
+
+	memcpy(mbox_dma, buf, size);
+	dcache_clean_inval(mbox_dma, size);
+	mbox.inflight = BUS_ADDRESS((u32) phys) | chan;
+	mbox.done = FALSE;
+	wmb(); // before the IRQ handler can see the reply
+
+	while (vmmio_read32(MAILBOX1_STATUS) & MAILBOX_STATUS_FULL) {
+		if (arch_counter_read() > deadline) {
+			ret = -1;
+			goto out;
+		}
+	}
+	vmmio_write32(MAILBOX1_WRITE, mbox.inflight);
+
+	if (!mbox_wait(use_irq, deadline)) {
+		mbox.stale = TRUE;
+		mbox.timeouts++;
+		ret = -1;
+		goto out;
+	}
+
+	if (use_irq)
+		mbox.by_irq++;
+	else
+		mbox.polled++;
+	dcache_clean_inval(mbox_dma, size);
+	memcpy(buf, mbox_dma, size);
+
+out:
+	if (!mbox.stale)
+		mbox.inflight = 0;
+	smp_store_release(&mbox.busy, 0);
+	return ret;
+}
+
+int mbox_msg_send(struct mbox_msg *m)
+{
+	if (m->overflow)
+		return -1;
+
+	m->buf[m->len] = MBOX_TAG_END;
+	m->buf[0] = (m->len + 1) * sizeof(u32);
+	m->buf[1] = MBOX_CODE_REQUEST;
+
+	if (mbox_call(BCM_MAILBOX_PROP_OUT, m->buf, m->buf[0]) < 0)
+		return -1;
+
+	mbox.messages++;
+	for (unsigned i = 2; i < m->len; i += 3 + m->buf[i + 1] / sizeof(u32))
+		mbox.tags++;
+
+	return m->buf[1] == MBOX_CODE_RESPONSE_OK ? 0 : -1;
+}
+
+int mbox_property_tag(u32 tag, u32 *val, unsigned nval)
+{
+	struct mbox_msg m;
+	const u32 *resp;
+
+	mbox_msg_init(&m);
+	int handle = mbox_msg_add(&m, tag, val, nval, nval);
+
+	if (mbox_msg_send(&m) < 0 || !(resp = mbox_msg_value(&m, handle, NULL)))
+		return -1;
+
+	memcpy(val, resp, nval * sizeof(u32));
+	return 0;
+}
+
+void mbox_init(void)
+{
+	if (request_irq(ARM_IRQ_ARM_MAILBOX, mbox_irq_handler, NULL) < 0)
+		return;
+
+	vmmio_write32(MAILBOX0_CONFIG, MAILBOX_CONFIG_IRQEN);
+	mbox.irq_ready = TRUE;
+}
+
+void mbox_stats_dump(void)
+{
+	printk("mailbox: %lu messages carrying %lu tags; %lu by IRQ, %lu polled, %lu timed out; "
+	       "%lu IRQs, %lu late and %lu stray replies\r\n", mbox.messages, mbox.tags,
+	       mbox.by_irq, mbox.polled, mbox.timeouts, mbox.irqs, mbox.late, mbox.stray);
+}
@@ -54,11 +54,18 @@ void muart_init(void)
 	selector |= 2<<15;                      // set alt5 for gpio15
 	vmmio_write32(ARM_GPIO_GPFSEL1, selector);
 
+#if RASPPI <= 3
 	vmmio_write32(ARM_GPIO_GPPUD, 0);
-	delay(150);
+	udelay(1); // 150 cycles of the 250MHz core clock
 	vmmio_write32(ARM_GPIO_GPPUDCLK0, (1 << 14) | (1 << 15));
-	delay(150);
+	udelay(1);
 	vmmio_write32(ARM_GPIO_GPPUDCLK0, 0);
+#else
+	// BCM2711 has a 2-bit pull up/down field per pin instead; 0 = no pull
+	selector = vmmio_read32(ARM_GPIO_GPPUPPDN0);
+	selector &= ~((3 << 28) | (3 << 30));   // gpio14, gpio15
+	vmmio_write32(ARM_GPIO_GPPUPPDN0, selector);
+#endif
 
 	vmmio_write32(MUART_EN, 1);                   //Enable mini uart (this also enables access to it registers)
 	vmmio_write32(MUART_CR_REG, 0);               //Disable auto flow control and disable receiver and transmitter (for now)
@@ -21,7 +21,12 @@
 #include "mmio.h"
 #include "util/utils.h"
 #include "peripherals/uart0.h"
+#include "drivers/console.h"
 #include "exceptions.h"
+#include "softirq.h"
+#include "spinlock.h"
+#include "printk.h"
+#include "kstats.h"
 
 #define UART0_CLOCK	        (48000000UL)
 
@@ -30,6 +35,71 @@
 #define IBRD_115200	        ((unsigned int)(BRD_115200))
 #define FBRD_115200	        ((unsigned int)(((BRD_115200-IBRD_115200)*64)+0.5))
 
+#define UART0_FIFO_DEPTH        16
+
+static void uart0_irq_handler(void *arg);
+
+/* Console output ring; see console.h. head and tail run freely and are
+ * masked on use, so head - tail is always the number of bytes queued.
+ */
+static struct {
+	spinlock_t lock;
+	u32 head, tail;
+	BOOL started;                   // uart0_init() has run, the FIFO may be fed
+	BOOL sync;                      // console_panic()
+	struct console_stats stats;
+	char buf[CONSOLE_TX_RING_SIZE];
+} tx = {
+	.lock = SPINLOCK_INIT,
+};
+
+/* Received bytes. head and the stats are only written by uart0_irq_handler(),
+ * tail only by the consumer, on a line of its own; each publishes its index
+ * with a release so that the other side sees the bytes (or the free space)
+ * before the index moves.
+ */
+static struct {
+	u32 head;
+	struct console_rx_stats stats;
+	u32 tail __attribute__((aligned(64)));
+	char buf[CONSOLE_RX_RING_SIZE];
+} rx;
+
+/* Move as much of the ring into the TX FIFO as it has room for. An empty FIFO
+ * takes a whole burst without FR being polled between bytes. Called with
+ * tx.lock held, or by console_panic()'s owner.
+ */
+static void tx_fill_fifo(void)
+{
+	u32 n = 0, room = 0;
+
+	while (tx.tail != tx.head) {
+		if (!room) {
+			u32 fr = vmmio_read32(UART0_FR);
+
+			if (fr & FR_TXFE_MASK)
+				room = UART0_FIFO_DEPTH;
+			else if (!(fr & FR_TXFF_MASK))
+				room = 1;
+			else
+				break;
+		}
+		vmmio_write32(UART0_DR, tx.buf[tx.tail++ & (CONSOLE_TX_RING_SIZE - 1)]);
+		room--;
+		n++;
+	}
+	tx.stats.written += n;
+}
+
+/* Spin until the FIFO has taken at least one more byte from the ring */
+static void tx_wait_fifo(void)
+{
+	u32 tail = tx.tail;
+
+	while (tx.tail == tail)
+		tx_fill_fifo();
+}
+
 void uart0_init()
 {
 	u32 mask;
@@ -41,11 +111,18 @@ void uart0_init()
 	mask &= ~(4 << 15); // set AF0 for gpio15
 	vmmio_write32(ARM_GPIO_GPFSEL1, mask);
 
+#if RASPPI <= 3
 	vmmio_write32(ARM_GPIO_GPPUD, 0);
-	delay(150);
+	udelay(1); // 150 cycles of the 250MHz core clock
 	vmmio_write32(ARM_GPIO_GPPUDCLK0, BIT(14) | BIT(15));
-	delay(150);
+	udelay(1);
 	vmmio_write32(ARM_GPIO_GPPUDCLK0, 0);
+#else
+	// BCM2711 has a 2-bit pull up/down field per pin instead; 0 = no pull
+	mask = vmmio_read32(ARM_GPIO_GPPUPPDN0);
+	mask &= ~((3 << 28) | (3 << 30));   // gpio14, gpio15
+	vmmio_write32(ARM_GPIO_GPPUPPDN0, mask);
+#endif
 
 	vmmio_write32(UART0_CR, 0); // disable
 	vmmio_write32(UART0_IBRD, IBRD_115200); // setup br 115200
@@ -55,38 +132,204 @@ void uart0_init()
 	// enable hardware flow control
 	vmmio_write32(UART0_CR, CR_CTSEN_MASK | CR_RTSEN_MASK);
 
-	// enable Tx & Rx interrupts
-	vmmio_write32(UART0_IMSC, IMSC_RXIM | IMSC_TXIM);
-	// set Rx & Tx FIFO interrupt trigger levels to 1/8 full
-	vmmio_write32(UART0_IFLS, (IFLS_IFSEL_1_8 << IFLS_RXIFSEL_SHIFT) | (IFLS_IFSEL_1_8 << IFLS_TXIFSEL_SHIFT));
+	// enable Tx, Rx & Rx timeout interrupts
+	vmmio_write32(UART0_IMSC, IMSC_RXIM | IMSC_RTIM | IMSC_TXIM);
+	// Rx interrupt at 1/2 full (8 bytes, with ~700us left before an overrun at
+	// 115200); the timeout interrupt picks up whatever is left below that once
+	// the line has been idle for 32 bit periods. Tx at 1/4 (4 bytes, ~350us of
+	// slack) so each refill is a 12-byte burst rather than a trickle
+	vmmio_write32(UART0_IFLS, (IFLS_IFSEL_1_2 << IFLS_RXIFSEL_SHIFT) | (IFLS_IFSEL_1_4 << IFLS_TXIFSEL_SHIFT));
 
 	// enable tx,rx
 	vmmio_write32(UART0_CR, CR_UART_EN_MASK | CR_TXE_MASK | CR_RXE_MASK);
+
+	request_irq(ARM_IRQ_UART, uart0_irq_handler, NULL);
+
+	/* whatever was printed before now has been waiting in the ring */
+	u64 daif = spin_lock_irqsave(&tx.lock);
+	tx.started = TRUE;
+	tx_fill_fifo();
+	spin_unlock_irqrestore(&tx.lock, daif);
+}
+
+/* The TX interrupt only fires as the FIFO drains past its trigger level, so
+ * writers top the FIFO up themselves: an idle UART gets going right away, and
+ * from then on the interrupt keeps it fed from the ring.
+ */
+void console_write(const char *s, size_t len)
+{
+	if (READ_ONCE(tx.sync)) {
+		for (size_t i = 0; i < len; i++) {
+			while (tx.head - tx.tail == CONSOLE_TX_RING_SIZE)
+				tx_wait_fifo();
+			tx.buf[tx.head++ & (CONSOLE_TX_RING_SIZE - 1)] = s[i];
+		}
+		while (tx.tail != tx.head)
+			tx_wait_fifo();
+		return;
+	}
+
+	u64 daif = spin_lock_irqsave(&tx.lock);
+	BOOL can_wait = tx.started && !in_interrupt() && !(daif & BIT(7));
+	BOOL stalled = FALSE;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (tx.head - tx.tail == CONSOLE_TX_RING_SIZE) {
+			if (!can_wait)
+				break;
+			stalled = TRUE;
+			tx_wait_fifo();
+		}
+		tx.buf[tx.head++ & (CONSOLE_TX_RING_SIZE - 1)] = s[i];
+	}
+
+	tx.stats.queued += i;
+	tx.stats.stalls += stalled;
+	if (i < len) {
+		tx.stats.dropped += len - i;
+		tx.stats.overflows++;
+	}
+	if (tx.head - tx.tail > tx.stats.max_depth)
+		tx.stats.max_depth = tx.head - tx.tail;
+
+	if (tx.started)
+		tx_fill_fifo();
+	spin_unlock_irqrestore(&tx.lock, daif);
 }
 
-/* purposely don't buffer this! we will do that in a separate kernel thread (watch_keyboard) */
-static char console_read_char;
+void console_putc(char c)
+{
+	console_write(&c, 1);
+}
+
+size_t console_read(char *buf, size_t len)
+{
+	u32 tail = rx.tail;
+	u32 avail = smp_load_acquire(&rx.head) - tail;
+	u32 off = tail & (CONSOLE_RX_RING_SIZE - 1);
+
+	if (len > avail)
+		len = avail;
+	if (!len)
+		return 0;
+
+	/* at most two pieces: up to the end of the buffer, then from its start */
+	size_t first = CONSOLE_RX_RING_SIZE - off;
+	if (first > len)
+		first = len;
+	memcpy(buf, &rx.buf[off], first);
+	if (len > first)
+		memcpy(buf + first, rx.buf, len - first);
+
+	smp_store_release(&rx.tail, tail + (u32) len);
+	return len;
+}
+
+int console_getc(void)
+{
+	char c;
+
+	return console_read(&c, 1) ? (u8) c : -1;
+}
+
+size_t console_rx_pending(void)
+{
+	return smp_load_acquire(&rx.head) - rx.tail;
+}
+
+void console_panic(void)
+{
+	WRITE_ONCE(tx.sync, TRUE);
+	while (tx.tail != tx.head)
+		tx_wait_fifo();
+}
+
+void console_stats_dump(void)
+{
+	u64 daif = spin_lock_irqsave(&tx.lock);
+	struct console_stats st = tx.stats;
+	u32 depth = tx.head - tx.tail;
+	spin_unlock_irqrestore(&tx.lock, daif);
+
+	printk("console: %lu bytes queued, %lu written, %u pending (max %u of %u)\r\n",
+	       st.queued, st.written, depth, st.max_depth, CONSOLE_TX_RING_SIZE);
+	printk("console: %lu tx irqs, %lu stalled writes, %lu bytes dropped in %lu overflows\r\n",
+	       st.tx_irqs, st.stalls, st.dropped, st.overflows);
+	/* only the IRQ handler updates these, and it takes no lock */
+	printk("console: %lu bytes received in %lu rx irqs, %lu dropped, %lu errors, %lu pending\r\n",
+	       READ_ONCE(rx.stats.bytes), READ_ONCE(rx.stats.irqs),
+	       READ_ONCE(rx.stats.dropped), READ_ONCE(rx.stats.errors), console_rx_pending());
+}
+
+/* The KOS handlers may take their time, so they run as tasklets with IRQs
+ * unmasked; the hard handler only acknowledges the UART and empties the RX
+ * FIFO into the ring, which the handler then reads with console_read().
+ */
+static void uart0_rx_work(unsigned long data)
+{
+	(void) data;
+#ifdef DEBUG
+	printk("Received %lu bytes\r\n", console_rx_pending());
+#endif
+	call_KOS_handler(ConsoleReadInt);
+}
+
+static void uart0_tx_work(unsigned long data)
+{
+	(void) data;
+	/* the ring has drained; tell whoever wants to write more */
+	call_KOS_handler(ConsoleWriteInt);
+}
+
+static struct tasklet uart0_rx_tasklet = TASKLET_INIT(uart0_rx_work, 0);
+static struct tasklet uart0_tx_tasklet = TASKLET_INIT(uart0_tx_work, 0);
 
 __attribute__((optimize(2)))
-void uart0_irq_handler(void)
+static void uart0_irq_handler(void *arg)
 {
 	u32 int_type = vmmio_read32(UART0_MIS);
 	vmmio_write32(UART0_ICR, int_type);
 
-	if (int_type & MIS_RXMIS) {
-		console_read_char = vmmio_read32(UART0_DR);
-#ifdef DEBUG
-		printk("Received character: '%c'\r\n", console_read_char);
-#endif
-		call_KOS_handler(ConsoleReadInt);
+	if (int_type & (MIS_RXMIS | MIS_RTMIS)) {
+		u32 head = rx.head, tail = smp_load_acquire(&rx.tail);
+		u32 start = head;
+
+		/* all of it, not just up to the trigger level: that's what RTIM is
+		 * waiting on, and a paste keeps the FIFO coming
+		 */
+		while (!(vmmio_read32(UART0_FR) & FR_RXFE_MASK)) {
+			u32 dr = vmmio_read32(UART0_DR);
+
+			if (dr & (DR_OE_MASK | DR_BE_MASK | DR_PE_MASK | DR_FE_MASK))
+				rx.stats.errors++;
+			if (dr & (DR_BE_MASK | DR_PE_MASK | DR_FE_MASK))
+				continue; // a bad byte; OE alone means a loss *after* this one
+			if (kstats_key(dr & 0xFF))
+				continue;
+			if (head - tail == CONSOLE_RX_RING_SIZE) {
+				rx.stats.dropped++;
+				continue;
+			}
+			rx.buf[head++ & (CONSOLE_RX_RING_SIZE - 1)] = dr & 0xFF;
+		}
+
+		rx.stats.irqs++;
+		rx.stats.bytes += head - start;
+		smp_store_release(&rx.head, head);
+		if (head != start)
+			tasklet_schedule(&uart0_rx_tasklet);
 	}
 	if (int_type & MIS_TXMIS) {
-		/* console_write() is what actually accesses the DR here */
-		call_KOS_handler(ConsoleWriteInt);
-	}
+		u64 daif = spin_lock_irqsave(&tx.lock);
+		BOOL drained;
 
-#ifdef DEBUG
-	if (int_type & ~(MIS_TXMIS | MIS_RXMIS))
-	printk("other interrupt occurred in uart0\r\n");
-#endif
+		tx.stats.tx_irqs++;
+		tx_fill_fifo();
+		drained = tx.tail == tx.head;
+		spin_unlock_irqrestore(&tx.lock, daif);
+
+		if (drained)
+			tasklet_schedule(&uart0_tx_tasklet);
+	}
 }
@@ -0,0 +1,221 @@
+/*
+ * rcu.c - read-copy-update
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rcu.h"
+#include "assert.h"
+#include "exceptions.h"
+#include "ipi.h"
+#include "printk.h"
+#include "smp.h"
+#include "softirq.h"
+#include "spinlock.h"
+#include "util/utils.h"
+
+struct rcu_list {
+	struct rcu_head *head;
+	struct rcu_head **tail;
+};
+
+/* Writes are rare enough for one lock to do. Callbacks move from `next' to
+ * `wait' when a grace period starts and from `wait' to `done' when it ends;
+ * the ones in `next' came too late for the grace period in progress.
+ */
+static struct {
+	spinlock_t lock;
+	u64 gp_cur;                     // grace periods started
+	volatile u64 gp_done;           // and finished
+	volatile u32 qs_mask;           // cores yet to pass through a quiescent state
+	struct rcu_list next, wait, done;
+
+	u64 queued;                     // call_rcu()s
+	u64 invoked;
+} rcu;
+
+DEFINE_PER_CPU(volatile BOOL, rcu_qs_wanted);
+static DEFINE_PER_CPU(u64, rcu_qs_reported);
+
+static inline void rcu_list_init(struct rcu_list *l)
+{
+	l->head = NULL;
+	l->tail = &l->head;
+}
+
+static inline void rcu_list_splice(struct rcu_list *to, struct rcu_list *from)
+{
+	if (!from->head)
+		return;
+
+	*to->tail = from->head;
+	to->tail = from->tail;
+	rcu_list_init(from);
+}
+
+/* rcu.lock held. Whatever the writer unpublished before queueing its callback
+ * has to be visible to a core before it can report a quiescent state for
+ * this grace period.
+ */
+static void rcu_gp_start(void)
+{
+	u32 mask = cpu_online_mask;
+
+	rcu_list_splice(&rcu.wait, &rcu.next);
+	rcu.gp_cur++;
+
+	smp_mb();
+	WRITE_ONCE(rcu.qs_mask, mask);
+	smp_wmb();
+	for (unsigned cpu = 0; cpu < CORES; cpu++) {
+		if (mask & BIT(cpu)) {
+			per_cpu(rcu_qs_wanted, cpu) = TRUE;
+			smp_send_reschedule(cpu);
+		}
+	}
+}
+
+/* By the last core to report; IRQs masked */
+static void rcu_gp_end(void)
+{
+	spin_lock(&rcu.lock);
+	rcu_list_splice(&rcu.done, &rcu.wait);
+	smp_store_release(&rcu.gp_done, rcu.gp_cur);
+	if (rcu.next.head)
+		rcu_gp_start();
+	spin_unlock(&rcu.lock);
+
+	/* Callbacks run at the end of this IRQ or, from a switch, of the
+	 * softirq IPI raise_softirq() sends
+	 */
+	raise_softirq(SOFTIRQ_RCU);
+}
+
+void rcu_report_qs(void)
+{
+	unsigned cpu = smp_processor_id();
+
+	__this_cpu_write(rcu_qs_wanted, FALSE);
+	__this_cpu_add(rcu_qs_reported, 1);
+
+	/* ordered after every read-side access before it */
+	if (atomic_fetch_andnot(&rcu.qs_mask, BIT(cpu)) == BIT(cpu))
+		rcu_gp_end();
+}
+
+void rcu_read_unlock_special(void)
+{
+	struct thread *t = thread_current();
+
+	t->rcu_resched = FALSE;
+
+	/* an IRQ handler's read-side section ending in the middle of ours */
+	if (in_interrupt()) {
+		irq_set_need_resched();
+		return;
+	}
+	thread_yield();
+}
+
+void call_rcu(struct rcu_head *head, void (*func) (struct rcu_head *head))
+{
+	head->func = func;
+	head->next = NULL;
+
+	u64 daif = spin_lock_irqsave(&rcu.lock);
+	*rcu.next.tail = head;
+	rcu.next.tail = &head->next;
+	rcu.queued++;
+	if (rcu.gp_done == rcu.gp_cur)
+		rcu_gp_start();
+	spin_unlock_irqrestore(&rcu.lock, daif);
+}
+
+struct rcu_synchronize {
+	struct rcu_head head;
+	volatile BOOL done;
+};
+
+static void wakeme_after_rcu(struct rcu_head *head)
+{
+	struct rcu_synchronize *rs = container_of(head, struct rcu_synchronize, head);
+
+	smp_store_release(&rs->done, TRUE);
+	asm volatile ("sev");
+}
+
+void synchronize_rcu(void)
+{
+	struct rcu_synchronize rs = { .done = FALSE };
+
+	assert(!rcu_read_lock_held());
+
+	/* Alone, there's nobody to wait for: a reader is never switched out, so
+	 * no other thread on this core can be in the middle of one.
+	 */
+	if (cpu_online_mask == BIT(smp_processor_id())) {
+		smp_mb();
+		return;
+	}
+
+	call_rcu(&rs.head, wakeme_after_rcu);
+	while (!smp_load_acquire(&rs.done))
+		asm volatile ("wfe");
+}
+
+static void rcu_process_callbacks(void)
+{
+	struct rcu_head *head;
+	u64 n = 0;
+
+	u64 daif = spin_lock_irqsave(&rcu.lock);
+	head = rcu.done.head;
+	rcu_list_init(&rcu.done);
+	spin_unlock_irqrestore(&rcu.lock, daif);
+
+	while (head) {
+		struct rcu_head *next = head->next;
+
+		head->func(head);
+		head = next;
+		n++;
+	}
+
+	daif = spin_lock_irqsave(&rcu.lock);
+	rcu.invoked += n;
+	spin_unlock_irqrestore(&rcu.lock, daif);
+}
+
+void rcu_init(void)
+{
+	spin_lock_init(&rcu.lock);
+	rcu_list_init(&rcu.next);
+	rcu_list_init(&rcu.wait);
+	rcu_list_init(&rcu.done);
+	open_softirq(SOFTIRQ_RCU, rcu_process_callbacks);
+}
+
+void rcu_stats_dump(void)
+{
+	printk("rcu: %lu grace periods, %lu callbacks queued, %lu invoked\r\n",
+	       rcu.gp_done, rcu.queued, rcu.invoked);
+
+	for (unsigned cpu = 0; cpu < CORES; cpu++)
+		if (cpu_online_mask & BIT(cpu))
+			printk("core %u: %lu quiescent states reported\r\n", cpu,
+			       per_cpu(rcu_qs_reported, cpu));
+}
@@ -0,0 +1,702 @@
+/*
+ * sched.c - preemptive kernel threads
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sched.h"
+#include "arch_timer.h"
+#include "atomic.h"
+#include "assert.h"
+#include "printk.h"
+#include "ipi.h"
+#include "percpu.h"
+#include "rcu.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "util/utils.h"
+
+#define SPSR_EL1T               0x4     // EL1, SP_EL0, all exceptions unmasked
+
+static struct thread threads[SCHED_MAX_THREADS];
+static u8 thread_stacks[SCHED_MAX_THREADS][THREAD_STACK_SIZE] __attribute__((aligned(16)));
+
+/* One per core. Within each, one FIFO per priority and a bitmap of the
+ * non-empty ones: picking the next thread is a count-trailing-zeros. Only the
+ * owning core switches threads in and out of `curr', and it holds `lock' for
+ * the whole of sched_switch(); other cores take it to queue wake-ups and
+ * (with a trylock, so two idle cores can't deadlock) to steal.
+ */
+struct rq {
+	spinlock_t lock;
+	unsigned cpu;
+	u32 bitmap;
+	struct thread *head[SCHED_PRIOS];
+	struct thread *tail[SCHED_PRIOS];
+	volatile unsigned nr_running;   // queued, not counting `curr'
+	struct thread *curr;
+	struct thread *idle;
+	struct hrtimer slice_timer;
+
+	u64 switches;
+	u64 migrations;                 // threads that moved here
+	u64 steals;
+	u64 steal_fails;                // lock contended or nothing worth taking
+	u64 nr_running_sum;             // sampled at every switch
+	unsigned nr_running_max;
+	u64 started;                    // counter value at rq_start()
+	u64 idle_ticks;                 // spent in WFI/WFE in sched_idle()
+	volatile u64 idle_entered;      // counter value going into the current one, or 0
+	u64 idle_wakeups;               // from WFI
+	u64 idle_polls;                 // WFEs waiting for something to go cold
+};
+
+static DEFINE_PER_CPU(struct rq, runqueues);
+
+static u64 migration_cost_ticks;
+
+/* Cores asleep in WFI, which only an interrupt gets them out of */
+static volatile u32 idle_cpus;
+
+static inline struct rq *this_rq(void)
+{
+	return this_cpu_ptr(&runqueues);
+}
+
+static inline struct rq *cpu_rq(unsigned cpu)
+{
+	return per_cpu_ptr(&runqueues, cpu);
+}
+
+/* All run queue manipulation happens with the run queue locked and IRQs masked */
+static void runq_add(struct rq *rq, struct thread *t)
+{
+	t->state = THREAD_RUNNABLE;
+	t->next = NULL;
+	if (rq->tail[t->prio])
+		rq->tail[t->prio]->next = t;
+	else
+		rq->head[t->prio] = t;
+	rq->tail[t->prio] = t;
+	rq->bitmap |= BIT(t->prio);
+
+	rq->nr_running++;
+	if (rq->nr_running > rq->nr_running_max)
+		rq->nr_running_max = rq->nr_running;
+}
+
+/* Unlinks `t', found after `before' (NULL if it's the head) */
+static void runq_unlink(struct rq *rq, struct thread *t, struct thread *before)
+{
+	unsigned prio = t->prio;
+
+	if (before)
+		before->next = t->next;
+	else
+		rq->head[prio] = t->next;
+	if (rq->tail[prio] == t)
+		rq->tail[prio] = before;
+	if (!rq->head[prio])
+		rq->bitmap &= ~BIT(prio);
+
+	t->next = NULL;
+	rq->nr_running--;
+}
+
+static struct thread *runq_pop(struct rq *rq)
+{
+	if (!rq->bitmap)
+		return NULL;
+
+	struct thread *t = rq->head[__builtin_ctz(rq->bitmap)];
+	runq_unlink(rq, t, NULL);
+	return t;
+}
+
+static inline BOOL cache_hot(const struct thread *t, u64 now)
+{
+	return now - t->switched_out < migration_cost_ticks;
+}
+
+/* Most urgent first, and among those the first one whose cache footprint is
+ * likely gone. A hot thread only goes if the victim has more queued than just
+ * it; that core would otherwise get to it soon enough.
+ */
+static struct thread *steal_pick(struct rq *victim, u64 now)
+{
+	struct thread *hot = NULL, *hot_before = NULL;
+
+	for (u32 prios = victim->bitmap; prios; prios &= prios - 1) {
+		struct thread *before = NULL;
+
+		for (struct thread *t = victim->head[__builtin_ctz(prios)]; t; before = t, t = t->next) {
+			if (!cache_hot(t, now)) {
+				runq_unlink(victim, t, before);
+				return t;
+			}
+			if (!hot) {
+				hot = t;
+				hot_before = before;
+			}
+		}
+	}
+
+	if (hot && victim->nr_running >= 2) {
+		runq_unlink(victim, hot, hot_before);
+		return hot;
+	}
+	return NULL;
+}
+
+/* Called with `rq' locked, when it has nothing to run */
+static struct thread *steal(struct rq *rq, u64 now)
+{
+	unsigned self = rq->cpu;
+	struct rq *busiest = NULL;
+	unsigned most = 0;
+
+	for (unsigned core = 0; core < CORES; core++) {
+		unsigned n = cpu_rq(core)->nr_running;
+		if (core != self && (cpu_online_mask & BIT(core)) && n > most) {
+			busiest = cpu_rq(core);
+			most = n;
+		}
+	}
+
+	if (!busiest)
+		return NULL;
+
+	if (!spin_trylock(&busiest->lock)) {
+		rq->steal_fails++;
+		return NULL;
+	}
+
+	struct thread *t = steal_pick(busiest, now);
+	if (t) {
+		t->cpu = self;
+		t->migrations++;
+		rq->migrations++;
+		rq->steals++;
+	} else {
+		rq->steal_fails++;
+	}
+	spin_unlock(&busiest->lock);
+
+	return t;
+}
+
+static enum hrtimer_restart slice_expired(struct hrtimer *timer)
+{
+	struct rq *rq = container_of(timer, struct rq, slice_timer);
+
+	/* only worth switching for someone at least as urgent */
+	if (!rq->bitmap || __builtin_ctz(rq->bitmap) > rq->curr->prio)
+		return HRTIMER_NORESTART;
+
+	/* armed by a thread_wake() on another core */
+	if (rq == this_rq())
+		irq_set_need_resched();
+	else
+		smp_send_reschedule(rq->cpu);
+	return HRTIMER_NORESTART;
+}
+
+void sched_switch(struct ExceptionFrame *frame)
+{
+	struct rq *rq = this_rq();
+	struct thread *prev, *next;
+	u64 now = arch_counter_read();
+
+	spin_lock(&rq->lock);
+	prev = rq->curr;
+
+	/* a reader is never switched out (see rcu_read_unlock()) */
+	assert(prev->rcu_nesting == 0);
+	rcu_note_qs();
+
+	/* the idle thread only runs when nothing else can; a prev that's already
+	 * RUNNABLE was woken by another core on its way to blocking
+	 */
+	if (prev->state == THREAD_RUNNING && prev != rq->idle) {
+		if (!rq->bitmap || __builtin_ctz(rq->bitmap) > prev->prio) {
+			spin_unlock(&rq->lock);
+			return;
+		}
+		runq_add(rq, prev);
+	}
+
+	next = runq_pop(rq);
+	if (!next)
+		next = steal(rq, now);
+	if (!next)
+		next = rq->idle;
+	next->state = THREAD_RUNNING;
+
+	rq->nr_running_sum += rq->nr_running;
+
+	if (next != prev) {
+		/* stolen before its old core finished switching it out */
+		while (smp_load_acquire(&next->on_cpu))
+			asm volatile ("yield");
+
+		prev->runtime += now - prev->last_run;
+		prev->switched_out = now;
+		memcpy(&prev->ctx, frame, sizeof(*frame));
+		memcpy(frame, &next->ctx, sizeof(*frame));
+
+		next->on_cpu = TRUE;
+		next->last_run = now;
+		next->switches++;
+		rq->curr = next;
+		rq->switches++;
+		asm volatile ("msr tpidr_el0, %0" :: "r" (next));
+
+		smp_store_release(&prev->on_cpu, FALSE);
+		if (prev->state == THREAD_DEAD)
+			smp_store_release(&prev->state, THREAD_FREE);
+	}
+
+	/* Only tick while there's someone to share the CPU with */
+	if (rq->bitmap && next != rq->idle)
+		hrtimer_start_rel(&rq->slice_timer, SCHED_TIMESLICE_NS);
+	else
+		hrtimer_cancel(&rq->slice_timer);
+
+	spin_unlock(&rq->lock);
+}
+
+/* Voluntary switches go through an SVC so that they leave the same kind of
+ * frame behind as preemption does; see SyncStub.
+ */
+static inline void sched_svc(void)
+{
+	asm volatile ("svc #0" ::: "memory");
+}
+
+void thread_yield(void)
+{
+	sched_svc();
+}
+
+static enum hrtimer_restart sleep_timer_fn(struct hrtimer *timer)
+{
+	thread_wake(container_of(timer, struct thread, sleep_timer));
+	return HRTIMER_NORESTART;
+}
+
+_Noreturn void thread_exit(void)
+{
+	disable_irq();
+	struct rq *rq = this_rq();
+	struct thread *self = rq->curr;
+
+	hrtimer_cancel(&self->sleep_timer);
+	spin_lock(&rq->lock);
+	self->state = THREAD_DEAD;
+	spin_unlock(&rq->lock);
+
+	sched_svc();
+	__builtin_unreachable();
+}
+
+static void thread_trampoline(void (*fn) (void *), void *arg)
+{
+	fn(arg);
+	thread_exit();
+}
+
+/* Queued plus running; a lockless snapshot is good enough for placement */
+static inline unsigned rq_load(const struct rq *rq)
+{
+	return rq->nr_running + (rq->curr != rq->idle);
+}
+
+static unsigned least_loaded_cpu(void)
+{
+	unsigned best = smp_processor_id();
+	unsigned best_load = rq_load(cpu_rq(best));
+
+	for (unsigned core = 0; core < CORES; core++) {
+		unsigned load = rq_load(cpu_rq(core));
+		if ((cpu_online_mask & BIT(core)) && load < best_load) {
+			best = core;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+struct thread *thread_create(const char *name, void (*fn) (void *), void *arg, unsigned prio)
+{
+	struct thread *t = NULL;
+
+	for (unsigned i = CORES; i < SCHED_MAX_THREADS && !t; i++) {
+		if (cmpxchg(&threads[i].state, THREAD_FREE, THREAD_BLOCKED) == THREAD_FREE) // reserved
+			t = &threads[i];
+	}
+
+	if (!t)
+		return NULL;
+
+	if (prio >= SCHED_PRIO_IDLE)
+		prio = SCHED_PRIO_IDLE - 1;
+
+	memset(&t->ctx, 0, sizeof(t->ctx));
+	t->ctx.x[0] = (u64) fn;
+	t->ctx.x[1] = (u64) arg;
+	t->ctx.elr_el1 = (u64) thread_trampoline;
+	t->ctx.spsr_el1 = SPSR_EL1T;
+	t->ctx.sp_el0 = (u64) thread_stacks[t - threads] + THREAD_STACK_SIZE;
+	t->prio = prio;
+	t->cpu = least_loaded_cpu();
+	t->on_cpu = FALSE;
+	t->name = name;
+	t->wake_pending = FALSE;
+	t->switches = 0;
+	t->migrations = 0;
+	t->runtime = 0;
+	t->switched_out = 0;
+	t->rcu_nesting = 0;
+	t->rcu_resched = FALSE;
+	hrtimer_init(&t->sleep_timer, sleep_timer_fn);
+
+	thread_wake(t);
+	return t;
+}
+
+void thread_block(void)
+{
+	u64 daif = irq_save();
+	struct rq *rq = this_rq();
+	struct thread *self = rq->curr;
+
+	spin_lock(&rq->lock);
+	if (self->wake_pending) {
+		self->wake_pending = FALSE;
+		spin_unlock(&rq->lock);
+	} else {
+		self->state = THREAD_BLOCKED;
+		spin_unlock(&rq->lock);
+		sched_svc();
+	}
+
+	irq_restore(daif);
+}
+
+/* Locks the run queue `t' is on, chasing it if it gets stolen meanwhile */
+static struct rq *lock_thread_rq(struct thread *t)
+{
+	for (;;) {
+		struct rq *rq = cpu_rq(READ_ONCE(t->cpu));
+
+		spin_lock(&rq->lock);
+		if (rq == cpu_rq(t->cpu))
+			return rq;
+		spin_unlock(&rq->lock);
+	}
+}
+
+/* `t' was queued on `busy' behind a running thread: a core sleeping in WFI
+ * won't notice by itself, so wake one up to try stealing it. Pairs with the
+ * barrier in sched_idle().
+ */
+static void kick_idle_cpu(unsigned busy)
+{
+	smp_mb();
+	u32 idle = READ_ONCE(idle_cpus) & cpu_online_mask & ~BIT(busy);
+
+	if (idle)
+		smp_send_reschedule(__builtin_ctz(idle));
+}
+
+/* A woken thread goes back to the core it last ran on, for whatever it left
+ * in that core's caches; if that core stays busy, an idle one will steal it
+ * once it's gone cold. A remote core that should switch to it is kicked with
+ * a reschedule IPI.
+ */
+void thread_wake(struct thread *t)
+{
+	u64 daif = irq_save();
+	struct rq *rq = lock_thread_rq(t);
+
+	if (t->state != THREAD_BLOCKED) {
+		if (t->state == THREAD_RUNNING || t->state == THREAD_RUNNABLE)
+			t->wake_pending = TRUE;
+		spin_unlock(&rq->lock);
+		irq_restore(daif);
+		return;
+	}
+
+	runq_add(rq, t);
+	BOOL preempt = t->prio < rq->curr->prio || rq->curr == rq->idle;
+	BOOL local = rq == this_rq();
+
+	/* curr may have had the core to itself, with no slice running to ever
+	 * make it share; a slice already running is left to finish as it was
+	 */
+	if (!preempt && t->prio == rq->curr->prio && !READ_ONCE(rq->slice_timer.queued))
+		hrtimer_start_rel(&rq->slice_timer, SCHED_TIMESLICE_NS);
+	spin_unlock(&rq->lock);
+
+	if (!preempt)
+		kick_idle_cpu(rq->cpu);
+
+	if (!local) {
+		if (preempt)
+			smp_send_reschedule(rq->cpu);
+		irq_restore(daif);
+		return;
+	}
+
+	if (preempt && in_interrupt())
+		irq_set_need_resched();
+	irq_restore(daif);
+
+	if (preempt && !in_interrupt() && (daif & BIT(7)) == 0) // IRQs were unmasked
+		thread_yield();
+}
+
+void thread_sleep_ns(u64 ns)
+{
+	struct thread *self = thread_current();
+	u64 deadline = ktime_get_ns() + ns;
+
+	/* a wake-up left over from before, or anyone else's, ends a block early */
+	do {
+		hrtimer_start(&self->sleep_timer, deadline);
+		thread_block();
+	} while (ktime_get_ns() < deadline);
+
+	hrtimer_cancel(&self->sleep_timer);
+}
+
+static void rq_init(unsigned core)
+{
+	struct rq *rq = cpu_rq(core);
+	struct thread *idle = &threads[core];
+
+	memset(rq, 0, sizeof(*rq));
+	spin_lock_init(&rq->lock);
+	rq->cpu = core;
+	idle->state = THREAD_RUNNING;
+	idle->prio = SCHED_PRIO_IDLE;
+	idle->cpu = core;
+	idle->on_cpu = TRUE;
+	idle->name = "idle";
+	rq->idle = idle;
+	rq->curr = idle;
+}
+
+/* Per-core parts: the timers end up on the calling core's hrtimer base */
+static void rq_start(struct rq *rq)
+{
+	asm volatile ("msr tpidr_el0, %0" :: "r" (rq->idle));
+	rq->started = arch_counter_read();
+	rq->idle->last_run = rq->started;
+	hrtimer_init(&rq->idle->sleep_timer, sleep_timer_fn);
+	hrtimer_init(&rq->slice_timer, slice_expired);
+}
+
+void sched_init(void)
+{
+	memset(threads, 0, sizeof(threads));
+	migration_cost_ticks = arch_ns_to_ticks(SCHED_MIGRATION_COST_NS);
+
+	for (unsigned core = 0; core < CORES; core++)
+		rq_init(core);
+	rq_start(this_rq());
+}
+
+void sched_init_secondary(void)
+{
+	rq_start(this_rq());
+}
+
+/* Anything queued anywhere; stealing decides whether it's worth taking */
+static BOOL work_pending(void)
+{
+	for (unsigned core = 0; core < CORES; core++)
+		if (cpu_rq(core)->nr_running)
+			return TRUE;
+	return FALSE;
+}
+
+/* With nothing queued anywhere the core sleeps in WFI, clock gated, until an
+ * interrupt: anything woken up for this core has been switched to on the way
+ * out of it (a reschedule IPI, if it was from another core), and so has
+ * anything stolen after kick_idle_cpu(). There's no tick to wake us
+ * otherwise; the slice timer only runs while threads share a core.
+ *
+ * Work queued elsewhere that was too cache-hot to steal is polled for on the
+ * event stream (see delay_init()) in WFE until it isn't.
+ *
+ * The idle thread is never in an RCU read-side section, so every pass is a
+ * quiescent state.
+ */
+_Noreturn void sched_idle(void)
+{
+	while (1) {
+		u64 daif = irq_save();
+		struct rq *rq = this_rq();
+		BOOL poll;
+
+		rcu_note_qs();
+
+		/* advertise first, so that a wake-up racing with the check kicks us */
+		atomic_fetch_or(&idle_cpus, BIT(rq->cpu));
+		smp_mb();
+		poll = work_pending();
+		if (poll) {
+			atomic_fetch_andnot(&idle_cpus, BIT(rq->cpu));
+			irq_restore(daif);
+			thread_yield();
+			daif = irq_save();
+		}
+
+		/* an IRQ that comes in meanwhile still ends the WFI; it's taken once
+		 * we unmask, after the accounting
+		 */
+		u64 start = arch_counter_read();
+		rq->idle_entered = start;
+		if (poll) {
+			asm volatile ("wfe");
+			rq->idle_polls++;
+		} else {
+			asm volatile ("dsb sy\n\twfi" ::: "memory");
+			rq->idle_wakeups++;
+			atomic_fetch_andnot(&idle_cpus, BIT(rq->cpu));
+		}
+		rq->idle_entered = 0;
+		rq->idle_ticks += arch_counter_read() - start;
+		irq_restore(daif);
+	}
+}
+
+/* Unlocked, so it can be off by one nap's worth either way; fine for sampling */
+u64 sched_idle_ticks(unsigned cpu)
+{
+	struct rq *rq = cpu_rq(cpu);
+	u64 entered = rq->idle_entered;
+	u64 ticks = READ_ONCE(rq->idle_ticks);
+
+	if (entered)
+		ticks += arch_counter_read() - entered;
+	return ticks;
+}
+
+void sched_stats_dump(void)
+{
+	for (unsigned core = 0; core < CORES; core++) {
+		struct rq *rq = cpu_rq(core);
+		if (!(cpu_online_mask & BIT(core)))
+			continue;
+
+		printk("core %u: switches %lu, migrations in %lu, steals %lu (%lu failed), "
+		       "queue len max %u avg %lu.%02lu\r\n", core, rq->switches, rq->migrations,
+		       rq->steals, rq->steal_fails, rq->nr_running_max,
+		       rq->switches ? rq->nr_running_sum / rq->switches : 0,
+		       rq->switches ? rq->nr_running_sum * 100 / rq->switches % 100 : 0);
+
+		/* per 10000, for two decimals of a percentage */
+		u64 up = arch_counter_read() - rq->started;
+		u64 idle = up ? rq->idle_ticks * 10000 / up : 0;
+		u64 naps = rq->idle_wakeups + rq->idle_polls;
+
+		printk("        idle %lu.%02lu%% of %lu ms: %lu WFI wake-ups, %lu WFE polls, "
+		       "avg residency %lu us\r\n", idle / 100, idle % 100,
+		       arch_ticks_to_ns(up) / NSEC_PER_MSEC, rq->idle_wakeups, rq->idle_polls,
+		       naps ? arch_ticks_to_ns(rq->idle_ticks) / naps / 1000 : 0);
+	}
+
+	for (unsigned i = 0; i < SCHED_MAX_THREADS; i++) {
+		struct thread *t = &threads[i];
+		if (t->state == THREAD_FREE)
+			continue;
+
+		printk("%-12s prio %2u cpu %u state %u switches %lu migrations %lu runtime %lu us\r\n",
+		       t->name, t->prio, t->cpu, t->state, t->switches, t->migrations,
+		       arch_ticks_to_ns(t->runtime) / 1000);
+	}
+}
+
+#ifdef SCHED_BENCH
+
+#define BENCH_THREADS           (SCHED_MAX_THREADS - CORES - 1) // the single one may not be freed yet
+#define BENCH_ITERATIONS        (1UL << 24)
+#define BENCH_YIELD_EVERY       (1UL << 16) // so the run queues get some exercise
+
+static volatile unsigned bench_done;
+static volatile u64 bench_sink;
+
+static void bench_fn(void *arg)
+{
+	u64 x = (u64) arg | 1;
+
+	for (unsigned long i = 0; i < BENCH_ITERATIONS; i++) {
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17; // xorshift64
+		if ((i & (BENCH_YIELD_EVERY - 1)) == 0)
+			thread_yield();
+	}
+
+	bench_sink = x;
+	atomic_inc(&bench_done);
+}
+
+/* Counter ticks for `n' threads' worth of bench_fn() */
+static u64 bench_run(unsigned n)
+{
+	bench_done = 0;
+	u64 start = arch_counter_read();
+
+	/* masked, so that thread_wake() doesn't switch to each one as it's created */
+	u64 daif = irq_save();
+	for (unsigned i = 0; i < n; i++) {
+		if (!thread_create("bench", bench_fn, (void *) (u64) (i + 1), SCHED_PRIO_DEFAULT)) {
+			irq_restore(daif);
+			return 0;
+		}
+	}
+	irq_restore(daif);
+
+	/* we're the idle thread, so this is also what lets the bench threads run here */
+	while (smp_load_acquire(&bench_done) < n) {
+		thread_yield();
+		asm volatile ("wfe");
+	}
+
+	return arch_counter_read() - start;
+}
+
+void sched_bench(void)
+{
+	unsigned cores = __builtin_popcount(cpu_online_mask);
+	u64 one = bench_run(1);
+	u64 many = bench_run(BENCH_THREADS);
+
+	if (!one || !many) {
+		printk("sched_bench: out of threads\r\n");
+		return;
+	}
+
+	/* speed-up over running the same threads back to back on one core */
+	u64 speedup = one * BENCH_THREADS * 100 / many;
+	printk("sched_bench: %u threads on %u cores: %lu us (1 thread: %lu us), speed-up %lu.%02lu\r\n",
+	       BENCH_THREADS, cores, arch_ticks_to_ns(many) / 1000, arch_ticks_to_ns(one) / 1000,
+	       speedup / 100, speedup % 100);
+	sched_stats_dump();
+}
+#endif // SCHED_BENCH
@@ -0,0 +1,95 @@
+/*
+ * smp.c - secondary core bring-up
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "smp.h"
+#include "atomic.h"
+#include "fdt.h"
+#include "hrtimer.h"
+#include "ipi.h"
+#include "irqstat.h"
+#include "percpu.h"
+#include "peripherals/irqchip.h"
+#include "printk.h"
+#include "sched.h"
+#include "util/utils.h"
+
+/* armstub8 parks cores 1-3 in WFE, each polling its own 64-bit slot here
+ * (physical addresses) until it holds something other than 0, then jumps
+ * there in EL2 with the MMU and caches off.
+ */
+#define SPIN_TABLE_BASE         0xD8UL
+#define SPIN_TABLE_SLOT(core)   ((volatile u64 *) (KERN_VM_BASE | (SPIN_TABLE_BASE + 8 * (core))))
+
+#define SECONDARY_TIMEOUT_US    100000
+
+extern char _start_secondary[];
+
+volatile u32 cpu_online_mask = BIT(0);
+
+_Noreturn void secondary_main(unsigned core)
+{
+	percpu_init_secondary(core);
+	delay_init();
+	irqchip_init_secondary();
+	irqstat_init_cpu();
+	sched_init_secondary();
+	hrtimers_init_secondary();
+	ipi_init_secondary();
+
+	/* from here on the other cores may steal from / place threads on us */
+	atomic_fetch_or(&cpu_online_mask, BIT(core));
+	asm volatile ("sev");
+
+	enable_irq();
+	enable_fiq();
+	sched_idle();
+}
+
+unsigned smp_boot_secondaries(void)
+{
+	/* the image is linked at KERN_VM_BASE | its physical address */
+	u64 entry = (u64) _start_secondary & ~KERN_VM_BASE;
+	unsigned online = 1, cores = CORES;
+
+	/* don't wait out the timeout on cores the board doesn't have */
+	if (boot_info.valid && boot_info.nr_cpus && boot_info.nr_cpus < cores)
+		cores = boot_info.nr_cpus;
+
+	for (unsigned core = 1; core < cores; core++) {
+		volatile u64 *slot = SPIN_TABLE_SLOT(core);
+
+		*slot = entry;
+		/* they read it with their caches off */
+		asm volatile ("dc civac, %0\n\tdsb sy\n\tsev" :: "r" (slot) : "memory");
+
+		for (unsigned us = 0; us < SECONDARY_TIMEOUT_US; us += 10) {
+			if (smp_load_acquire(&cpu_online_mask) & BIT(core))
+				break;
+			udelay(10);
+		}
+
+		if (cpu_online_mask & BIT(core))
+			online++;
+		else
+			printk("core %u didn't come up\r\n", core);
+	}
+
+	return online;
+}
@@ -0,0 +1,277 @@
+/*
+ * softirq.c - deferred interrupt work
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "softirq.h"
+#include "atomic.h"
+#include "arch_timer.h"
+#include "hrtimer.h"
+#include "exceptions.h"
+#include "ipi.h"
+#include "printk.h"
+#include "util/utils.h"
+#include "percpu.h"
+
+/* do_softirq() goes around again if more work was raised while it ran, but
+ * gives up after this many passes so that a constantly re-raising source
+ * can't keep the interrupted context from ever running. Whatever is left
+ * gets picked up SOFTIRQ_DEFER_NS later (or after an earlier IRQ).
+ */
+#define SOFTIRQ_MAX_RESTART     10
+#define SOFTIRQ_DEFER_NS        (100 * NSEC_PER_USEC)
+
+struct tasklet_list {
+	struct tasklet *head;
+	struct tasklet **tail;
+};
+
+/* Everything but the actions themselves is per core: softirqs run on the core
+ * that raised them, and only ever touch that core's state (with IRQs masked).
+ */
+struct softirq_cpu {
+	volatile u32 pending;
+	volatile BOOL running;
+	struct tasklet_list tasklets;
+	struct tasklet_list tasklets_hi;
+	struct softirq_stats stats[NR_SOFTIRQS];
+	u64 deferred; // times SOFTIRQ_MAX_RESTART was hit
+	u64 kicks;    // self-IPIs for softirqs raised outside of an IRQ
+	struct hrtimer defer_timer;
+};
+
+static softirq_action_t softirq_vec[NR_SOFTIRQS];
+static DEFINE_PER_CPU(struct softirq_cpu, softirq_cpu);
+
+static const char *const softirq_names[NR_SOFTIRQS] = {
+	[SOFTIRQ_HI] = "HI",
+	[SOFTIRQ_TIMER] = "TIMER",
+	[SOFTIRQ_TASKLET] = "TASKLET",
+	[SOFTIRQ_RCU] = "RCU",
+};
+
+static inline struct softirq_cpu *this_softirq(void)
+{
+	return this_cpu_ptr(&softirq_cpu);
+}
+
+void open_softirq(unsigned nr, softirq_action_t action)
+{
+	if (nr < NR_SOFTIRQS)
+		softirq_vec[nr] = action;
+}
+
+/* With IRQs masked: from thread context, nothing would look at `pending'
+ * before the next IRQ. The IPI is only taken once IRQs are unmasked, on the
+ * core whose `pending' it is.
+ */
+static inline void softirq_kick(struct softirq_cpu *sc)
+{
+	if (!in_interrupt()) {
+		sc->kicks++;
+		smp_send_softirq();
+	}
+}
+
+void raise_softirq(unsigned nr)
+{
+	if (nr >= NR_SOFTIRQS)
+		return;
+
+	u64 daif = irq_save();
+	struct softirq_cpu *sc = this_softirq();
+	sc->pending |= BIT(nr);
+	sc->stats[nr].raised++;
+	softirq_kick(sc);
+	irq_restore(daif);
+}
+
+BOOL in_softirq(void)
+{
+	u64 daif = irq_save();
+	BOOL running = this_softirq()->running;
+	irq_restore(daif);
+	return running;
+}
+
+/* Always entered with IRQs masked, so we can't move to another core under it */
+__attribute__((optimize(2)))
+void do_softirq(void)
+{
+	struct softirq_cpu *sc = this_softirq();
+	unsigned restart = SOFTIRQ_MAX_RESTART;
+	u32 pending;
+
+	if (sc->running || !sc->pending)
+		return;
+
+	sc->running = TRUE;
+
+	while ((pending = sc->pending) != 0) {
+		if (!restart--) {
+			sc->deferred++;
+			hrtimer_start_rel(&sc->defer_timer, SOFTIRQ_DEFER_NS);
+			break;
+		}
+
+		sc->pending = 0;
+		enable_irq();
+
+		while (pending) {
+			unsigned nr = __builtin_ctz(pending);
+			pending &= pending - 1;
+
+			if (!softirq_vec[nr])
+				continue;
+
+			u64 start = arch_counter_read();
+			softirq_vec[nr]();
+			u64 ticks = arch_counter_read() - start;
+
+			sc->stats[nr].runs++;
+			if (ticks > sc->stats[nr].max_ticks)
+				sc->stats[nr].max_ticks = ticks;
+		}
+
+		disable_irq();
+	}
+
+	sc->running = FALSE;
+}
+
+/* Only does its job from IRQ context, where there's always a do_softirq() to come */
+static enum hrtimer_restart softirq_defer_fn(struct hrtimer *timer)
+{
+	(void) timer;
+	return HRTIMER_NORESTART;
+}
+
+/* IRQs masked */
+static void tasklet_list_add(struct softirq_cpu *sc, struct tasklet *t, unsigned nr)
+{
+	struct tasklet_list *list = nr == SOFTIRQ_HI ? &sc->tasklets_hi : &sc->tasklets;
+
+	t->next = NULL;
+	*list->tail = t;
+	list->tail = &t->next;
+	sc->pending |= BIT(nr);
+}
+
+/* A tasklet runs on the core that scheduled it; if it's already queued
+ * (on any core) this is a no-op.
+ */
+static void tasklet_enqueue(struct tasklet *t, BOOL hi)
+{
+	unsigned nr = hi ? SOFTIRQ_HI : SOFTIRQ_TASKLET;
+	u64 daif = irq_save();
+	struct softirq_cpu *sc = this_softirq();
+
+	if (!(atomic_fetch_or(&t->state, TASKLET_STATE_SCHED) & TASKLET_STATE_SCHED))
+		tasklet_list_add(sc, t, nr);
+	sc->pending |= BIT(nr);
+	sc->stats[nr].raised++;
+	softirq_kick(sc);
+
+	irq_restore(daif);
+}
+
+void tasklet_schedule(struct tasklet *t)
+{
+	tasklet_enqueue(t, FALSE);
+}
+
+void tasklet_hi_schedule(struct tasklet *t)
+{
+	tasklet_enqueue(t, TRUE);
+}
+
+/* Runs with IRQs enabled; detaches the whole list first so that tasklets
+ * scheduled from here on (including by the callbacks themselves) wait for
+ * the next pass.
+ *
+ * SCHED is cleared before the callback, so that it can be scheduled again
+ * meanwhile; RUN is what keeps it off the other cores until the callback
+ * returns. One that's still running elsewhere goes back on our list for the
+ * next pass (or, after SOFTIRQ_MAX_RESTART of them, the deferred one).
+ */
+static void tasklet_run(struct softirq_cpu *sc, unsigned nr)
+{
+	struct tasklet_list *list = nr == SOFTIRQ_HI ? &sc->tasklets_hi : &sc->tasklets;
+	u64 daif = irq_save();
+	struct tasklet *t = list->head;
+	list->head = NULL;
+	list->tail = &list->head;
+	irq_restore(daif);
+
+	while (t) {
+		struct tasklet *next = t->next;
+
+		if (atomic_fetch_or(&t->state, TASKLET_STATE_RUN) & TASKLET_STATE_RUN) {
+			daif = irq_save();
+			tasklet_list_add(sc, t, nr);
+			irq_restore(daif);
+		} else {
+			atomic_fetch_andnot(&t->state, TASKLET_STATE_SCHED);
+			t->func(t->data);
+			atomic_fetch_andnot(&t->state, TASKLET_STATE_RUN);
+		}
+		t = next;
+	}
+}
+
+/* softirqs don't migrate (IRQs are only unmasked within do_softirq() itself),
+ * so this_softirq() stays valid across the callbacks
+ */
+static void tasklet_action(void)
+{
+	tasklet_run(this_softirq(), SOFTIRQ_TASKLET);
+}
+
+static void tasklet_hi_action(void)
+{
+	tasklet_run(this_softirq(), SOFTIRQ_HI);
+}
+
+void softirq_init(void)
+{
+	for (unsigned core = 0; core < CORES; core++) {
+		struct softirq_cpu *sc = per_cpu_ptr(&softirq_cpu, core);
+
+		sc->tasklets.tail = &sc->tasklets.head;
+		sc->tasklets_hi.tail = &sc->tasklets_hi.head;
+		hrtimer_init(&sc->defer_timer, softirq_defer_fn);
+	}
+
+	open_softirq(SOFTIRQ_HI, tasklet_hi_action);
+	open_softirq(SOFTIRQ_TASKLET, tasklet_action);
+}
+
+void softirq_stats_dump(void)
+{
+	for (unsigned core = 0; core < CORES; core++) {
+		struct softirq_cpu *sc = per_cpu_ptr(&softirq_cpu, core);
+
+		for (unsigned nr = 0; nr < NR_SOFTIRQS; nr++) {
+			struct softirq_stats *s = &sc->stats[nr];
+			printk("core %u softirq %-8s raised %lu, runs %lu, max %lu ns\r\n", core,
+			       softirq_names[nr], s->raised, s->runs, arch_ticks_to_ns(s->max_ticks));
+		}
+		printk("core %u softirq restart limit hit %lu times, %lu self-IPIs\r\n", core,
+		       sc->deferred, sc->kicks);
+	}
+}
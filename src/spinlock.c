@@ -0,0 +1,96 @@
+/*
+ * spinlock.c - lock contention statistics
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spinlock.h"
+
+#ifdef LOCKSTAT
+#include "arch_timer.h"
+#include "printk.h"
+
+/* Every lock that's been taken at least once, most recent first */
+static struct lock_stat *volatile lockstat_list;
+
+void lockstat_acquired(struct lock_stat *s, const char *name, u64 start, BOOL contended)
+{
+	u64 now = arch_counter_read();
+
+	/* first time round; we hold the lock, so only the list itself is shared */
+	if (!s->name) {
+		struct lock_stat *head;
+
+		s->name = name;
+		do {
+			head = READ_ONCE(lockstat_list);
+			s->next = head;
+		} while (cmpxchg(&lockstat_list, head, s) != head);
+	}
+
+	s->acquisitions++;
+	if (contended) {
+		u64 wait = now - start;
+
+		s->contentions++;
+		s->wait_ticks += wait;
+		if (wait > s->max_wait)
+			s->max_wait = wait;
+	}
+	s->acquired_at = now;
+}
+
+void lockstat_release(struct lock_stat *s)
+{
+	u64 hold = arch_counter_read() - s->acquired_at;
+
+	s->hold_ticks += hold;
+	if (hold > s->max_hold)
+		s->max_hold = hold;
+}
+
+/* Racy against locks being taken meanwhile, which only skews the numbers */
+void lockstat_reset(void)
+{
+	for (struct lock_stat *s = lockstat_list; s; s = s->next) {
+		s->acquisitions = 0;
+		s->contentions = 0;
+		s->wait_ticks = 0;
+		s->max_wait = 0;
+		s->hold_ticks = 0;
+		s->max_hold = 0;
+	}
+}
+
+void lockstat_dump(void)
+{
+	printk("lock                     address            acquired  contended  "
+	       "wait avg/max ns     hold avg/max ns\r\n");
+
+	for (struct lock_stat *s = lockstat_list; s; s = s->next) {
+		if (!s->acquisitions)
+			continue;
+
+		printk("%-24s %p %9lu %10lu %9lu/%-9lu %9lu/%-9lu\r\n", s->name, s,
+		       s->acquisitions, s->contentions,
+		       s->contentions ? arch_ticks_to_ns(s->wait_ticks) / s->contentions : 0,
+		       arch_ticks_to_ns(s->max_wait),
+		       arch_ticks_to_ns(s->hold_ticks) / s->acquisitions, arch_ticks_to_ns(s->max_hold));
+	}
+}
+
+#endif // LOCKSTAT
@@ -0,0 +1,291 @@
+/*
+ * timer_wheel.c - coarse timeouts on a hierarchical timer wheel
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timer_wheel.h"
+#include "hrtimer.h"
+#include "softirq.h"
+#include "util/utils.h"
+
+static struct timer_base timer_base;
+
+/* Only ticks while something is on the wheel */
+static struct hrtimer wheel_tick;
+static BOOL wheel_ticking;
+
+static inline void list_add(struct timer_list **head, struct timer_list *timer)
+{
+	timer->next = *head;
+	if (*head)
+		(*head)->pprev = &timer->next;
+	*head = timer;
+	timer->pprev = head;
+}
+
+static inline void list_del(struct timer_list *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+static struct timer_list **wheel_slot(struct timer_base *base, u64 expires)
+{
+	u64 idx = expires - base->clk;
+
+	if ((i64) idx < 0)                      // already due: next jiffy processed
+		return &base->tv1[base->clk & TVR_MASK];
+	if (idx < TVR_SIZE)
+		return &base->tv1[expires & TVR_MASK];
+
+	if (idx > 0xFFFFFFFFUL)
+		expires = base->clk + 0xFFFFFFFFUL;
+
+	for (unsigned lvl = 0; lvl < TVN_LEVELS - 1; lvl++)
+		if (idx < 1UL << (TVR_BITS + (lvl + 1) * TVN_BITS))
+			return &base->tvn[lvl][(expires >> (TVR_BITS + lvl * TVN_BITS)) & TVN_MASK];
+
+	return &base->tvn[TVN_LEVELS - 1][(expires >> (TVR_BITS + (TVN_LEVELS - 1) * TVN_BITS)) & TVN_MASK];
+}
+
+static void wheel_tick_start(u64 now);
+
+static void internal_add(struct timer_base *base, struct timer_list *timer)
+{
+	list_add(wheel_slot(base, timer->expires), timer);
+	base->pending++;
+}
+
+static void internal_del(struct timer_base *base, struct timer_list *timer)
+{
+	list_del(timer);
+	base->pending--;
+}
+
+/* Re-sorts one slot of level `lvl' into the levels below it; returns the slot
+ * index, so that 0 (a full revolution) means the level above is due as well.
+ */
+static unsigned cascade(struct timer_base *base, unsigned lvl)
+{
+	unsigned index = (base->clk >> (TVR_BITS + lvl * TVN_BITS)) & TVN_MASK;
+	struct timer_list *timer = base->tvn[lvl][index];
+
+	base->tvn[lvl][index] = NULL;
+	while (timer) {
+		struct timer_list *next = timer->next;
+		list_add(wheel_slot(base, timer->expires), timer);
+		timer = next;
+	}
+
+	return index;
+}
+
+/* Runs everything due up to and including jiffy `target'. Callbacks are
+ * called with IRQs as they were on entry and the base unlocked; the wheel
+ * with them masked and it locked.
+ */
+static void run_timers(struct timer_base *base, u64 target)
+{
+	struct mcs_node node;
+	u64 daif = mcs_lock_irqsave(&base->lock, &node);
+
+	while (base->pending && (i64) (target - base->clk) >= 0) {
+		unsigned index = base->clk & TVR_MASK;
+
+		if (!index)
+			for (unsigned lvl = 0; lvl < TVN_LEVELS && !cascade(base, lvl); lvl++)
+				;
+		base->clk++;
+
+		struct timer_list *timer;
+		while ((timer = base->tv1[index])) {
+			internal_del(base, timer);
+
+			mcs_unlock_irqrestore(&base->lock, &node, daif);
+			timer->function(timer);
+			daif = mcs_lock_irqsave(&base->lock, &node);
+		}
+	}
+
+	/* nothing pending: jump straight to the present */
+	if (!base->pending && (i64) (target - base->clk) >= 0)
+		base->clk = target + 1;
+
+	mcs_unlock_irqrestore(&base->lock, &node, daif);
+}
+
+void timer_setup(struct timer_list *timer, void (*function) (struct timer_list *))
+{
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->expires = 0;
+	timer->function = function;
+}
+
+BOOL mod_timer(struct timer_list *timer, u64 expires)
+{
+	struct mcs_node node;
+	u64 daif = mcs_lock_irqsave(&timer_base.lock, &node);
+	BOOL was = timer_pending(timer);
+
+	u64 now = get_jiffies();
+
+	if (was)
+		internal_del(&timer_base, timer);
+	else if (!timer_base.pending)
+		timer_base.clk = now; // may have been idle for a while
+	timer->expires = expires;
+	internal_add(&timer_base, timer);
+	wheel_tick_start(now);
+
+	mcs_unlock_irqrestore(&timer_base.lock, &node, daif);
+	return was;
+}
+
+void add_timer(struct timer_list *timer)
+{
+	mod_timer(timer, timer->expires);
+}
+
+BOOL del_timer(struct timer_list *timer)
+{
+	struct mcs_node node;
+	u64 daif = mcs_lock_irqsave(&timer_base.lock, &node);
+	BOOL was = timer_pending(timer);
+
+	if (was)
+		internal_del(&timer_base, timer);
+
+	mcs_unlock_irqrestore(&timer_base.lock, &node, daif);
+	return was;
+}
+
+static void timer_softirq(void)
+{
+	run_timers(&timer_base, get_jiffies());
+}
+
+/* Only has to get the softirq to run: which jiffy it is comes from the counter */
+static enum hrtimer_restart wheel_tick_fn(struct hrtimer *timer)
+{
+	raise_softirq(SOFTIRQ_TIMER);
+
+	/* against a mod_timer() on another core seeing us still ticking */
+	struct mcs_node node;
+	u64 daif = mcs_lock_irqsave(&timer_base.lock, &node);
+	BOOL idle = !timer_base.pending;
+	if (idle)
+		wheel_ticking = FALSE;
+	mcs_unlock_irqrestore(&timer_base.lock, &node, daif);
+
+	if (idle)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward(timer, ktime_get_ns(), TIMER_WHEEL_TICK_NS);
+	return HRTIMER_RESTART;
+}
+
+/* Called with the base locked (and so IRQs masked) */
+static void wheel_tick_start(u64 now)
+{
+	if (wheel_ticking)
+		return;
+
+	wheel_ticking = TRUE;
+	hrtimer_start(&wheel_tick, (now + 1) * TIMER_WHEEL_TICK_NS);
+}
+
+void timer_wheel_init(void)
+{
+	memset(&timer_base, 0, sizeof(timer_base));
+	mcs_lock_init(&timer_base.lock);
+	timer_base.clk = get_jiffies();
+
+	hrtimer_init(&wheel_tick, wheel_tick_fn);
+	open_softirq(SOFTIRQ_TIMER, timer_softirq);
+}
+
+#ifdef TIMER_WHEEL_BENCH
+#include "printk.h"
+
+#define BENCH_TIMERS            100000
+#define BENCH_SPAN              (1UL << 20) // jiffies; reaches into the third level
+
+/* ~3MB; kmalloc() isn't up yet */
+static struct timer_base bench_base;
+static struct timer_list bench_timers[BENCH_TIMERS];
+static unsigned long bench_fired;
+
+static void bench_fn(struct timer_list *timer)
+{
+	(void) timer;
+	bench_fired++;
+}
+
+static inline u64 bench_ns_per(u64 start, unsigned long n)
+{
+	return arch_ticks_to_ns(arch_counter_read() - start) / n;
+}
+
+/* Runs on a private timer_base, away from the real tick */
+void timer_wheel_bench(void)
+{
+	struct timer_base *base = &bench_base;
+	struct timer_list *timers = bench_timers;
+	u64 seed = 0x9E3779B97F4A7C15UL, start;
+
+	memset(base, 0, sizeof(*base));
+	mcs_lock_init(&base->lock);
+
+	/* Nothing else touches the private base, so IRQs stay on: the numbers
+	 * include whatever interrupts come in, but nothing waits 2M jiffies'
+	 * worth of walking for them.
+	 */
+	start = arch_counter_read();
+	for (unsigned i = 0; i < BENCH_TIMERS; i++) {
+		seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; // xorshift64
+		timer_setup(&timers[i], bench_fn);
+		timers[i].expires = base->clk + 1 + seed % BENCH_SPAN;
+		internal_add(base, &timers[i]);
+	}
+	printk("add:     %lu ns/timer\r\n", bench_ns_per(start, BENCH_TIMERS));
+
+	start = arch_counter_read();
+	for (unsigned i = 0; i < BENCH_TIMERS; i += 2) {
+		internal_del(base, &timers[i]);
+		timers[i].expires += BENCH_SPAN / 2;
+		internal_add(base, &timers[i]);
+	}
+	printk("mod:     %lu ns/timer\r\n", bench_ns_per(start, BENCH_TIMERS / 2));
+
+	start = arch_counter_read();
+	for (unsigned i = 1; i < BENCH_TIMERS; i += 4)
+		internal_del(base, &timers[i]);
+	printk("del:     %lu ns/timer\r\n", bench_ns_per(start, BENCH_TIMERS / 4));
+
+	unsigned long left = base->pending;
+	bench_fired = 0;
+	start = arch_counter_read();
+	run_timers(base, base->clk + 2 * BENCH_SPAN);
+	printk("expire:  %lu ns/timer (%lu of %lu fired, cascades included)\r\n",
+	       bench_ns_per(start, left), bench_fired, left);
+}
+#endif // TIMER_WHEEL_BENCH
@@ -0,0 +1,152 @@
+/*
+ * tlbflush.c - batched TLB maintenance
+ *
+ * piKOS: a minimal OS for Raspberry Pi 3 & 4
+ *  Copyright (C) 2023 Ryan Wenger
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tlbflush.h"
+#include "exceptions.h"
+#include "percpu.h"
+#include "printk.h"
+#include "smp.h"
+#include "util/memorymap.h"
+#include "util/utils.h"
+
+#define PAGE_MASK               (~(PAGE_SIZE - 1))
+
+/* TLBI operand: VA[55:12] in bits 43:0, the ASID in 63:48 */
+#define TLBI_VA(va)             (((va) >> PAGE_SHIFT) & ((1UL << 44) - 1))
+#define TLBI_ASID(asid)         ((u64) (asid) << 48)
+
+/* Only written by the owning core, with IRQs masked */
+struct tlb_stats {
+	u64 queued;             // pages unmapped
+	u64 batches;
+	u64 tlbi_va;            // single-page invalidates issued
+	u64 tlbi_full;          // whole-ASID invalidates issued
+};
+
+static DEFINE_PER_CPU(struct tlb_stats, tlb_stats);
+
+void tlb_batch_init(struct tlb_batch *batch, int asid)
+{
+	batch->asid = asid;
+	batch->full = false;
+	batch->nr = 0;
+	batch->pages = 0;
+	batch->queued = 0;
+}
+
+void tlb_batch_add(struct tlb_batch *batch, uintptr va, size_t size)
+{
+	uintptr start = va & PAGE_MASK;
+	uintptr end = (va + size + PAGE_SIZE - 1) & PAGE_MASK;
+	struct tlb_range *r;
+
+	if (start == end)
+		return;
+
+	batch->queued += (end - start) >> PAGE_SHIFT;
+	if (batch->full)
+		return;
+
+	/* touching or overlapping an existing range: grow that one */
+	for (r = batch->ranges; r < batch->ranges + batch->nr; r++) {
+		if (start <= r->end && end >= r->start) {
+			batch->pages -= (r->end - r->start) >> PAGE_SHIFT;
+			if (start < r->start)
+				r->start = start;
+			if (end > r->end)
+				r->end = end;
+			batch->pages += (r->end - r->start) >> PAGE_SHIFT;
+			goto out;
+		}
+	}
+
+	if (batch->nr == TLB_BATCH_RANGES) {
+		batch->full = true;
+		return;
+	}
+
+	batch->ranges[batch->nr++] = (struct tlb_range) { start, end };
+	batch->pages += (end - start) >> PAGE_SHIFT;
+
+out:
+	if (batch->pages > TLB_FLUSH_FULL_PAGES)
+		batch->full = true;
+}
+
+void tlb_batch_flush(struct tlb_batch *batch)
+{
+	u64 asid = TLBI_ASID(batch->asid);
+	u64 tlbi_va = 0;
+
+	if (!batch->queued)
+		return;
+
+	/* the other cores' table walkers have to see the tables as they are now */
+	asm volatile ("dsb ishst" ::: "memory");
+
+	if (batch->full) {
+		if (batch->asid == TLB_ASID_KERNEL)
+			asm volatile ("tlbi vmalle1is" ::: "memory");
+		else
+			asm volatile ("tlbi aside1is, %0" :: "r" (asid) : "memory");
+	} else {
+		for (unsigned i = 0; i < batch->nr; i++) {
+			struct tlb_range *r = &batch->ranges[i];
+
+			for (uintptr va = r->start; va < r->end; va += PAGE_SIZE, tlbi_va++) {
+				if (batch->asid == TLB_ASID_KERNEL)
+					asm volatile ("tlbi vaae1is, %0" :: "r" (TLBI_VA(va)) : "memory");
+				else
+					asm volatile ("tlbi vae1is, %0" :: "r" (asid | TLBI_VA(va)) : "memory");
+			}
+		}
+	}
+
+	/* one wait for the lot, on every core in the domain */
+	asm volatile ("dsb ish\n\tisb" ::: "memory");
+
+	u64 daif = irq_save();
+	struct tlb_stats *st = this_cpu_ptr(&tlb_stats);
+	st->queued += batch->queued;
+	st->batches++;
+	st->tlbi_va += tlbi_va;
+	st->tlbi_full += batch->full;
+	irq_restore(daif);
+
+	tlb_batch_init(batch, batch->asid);
+}
+
+/* A page at a time, every unmapped page would have cost a TLBI, a DSB and
+ * an IPI to each of the other cores.
+ */
+void tlb_stats_dump(void)
+{
+	for (unsigned cpu = 0; cpu < CORES; cpu++) {
+		struct tlb_stats *st = per_cpu_ptr(&tlb_stats, cpu);
+		u64 issued = st->tlbi_va + st->tlbi_full;
+
+		if (!(cpu_online_mask & BIT(cpu)) || !st->queued)
+			continue;
+
+		printk("core %u: %lu pages unmapped in %lu batches: %lu TLBIs (%lu full), "
+		       "%lu flushes and %lu syncs avoided\r\n", cpu, st->queued, st->batches,
+		       issued, st->tlbi_full, st->queued - issued, st->queued - st->batches);
+	}
+}
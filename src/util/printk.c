@@ -75,6 +75,13 @@
 #define PRINTK_FTOA_BUFFER_SIZE    32U
 #endif
 
+// printf()/vprintf() output buffer; a call's output goes out in one _write()
+// per this many characters (dynamically created on stack)
+// default: 128 byte
+#ifndef PRINTK_OUT_BUFFER_SIZE
+#define PRINTK_OUT_BUFFER_SIZE    128U
+#endif
+
 // support for the floating point type (%f)
 // default: activated
 #ifndef PRINTK_DISABLE_SUPPORT_FLOAT
@@ -172,6 +179,37 @@ static inline void _out_char(char character, void* buffer, size_t idx, size_t ma
 }
 
 
+// wrapper (used as buffer) for buffered _write() output
+typedef struct {
+  char   buf[PRINTK_OUT_BUFFER_SIZE];
+  size_t len;
+} out_write_type;
+
+
+// internal buffered _write wrapper; _out_write_flush() whatever is left at the end
+static inline void _out_write(char character, void* buffer, size_t idx, size_t maxlen)
+{
+  out_write_type* out = (out_write_type*)buffer;
+  (void)idx; (void)maxlen;
+  if (character) {
+    if (out->len == sizeof(out->buf)) {
+      _write(out->buf, out->len);
+      out->len = 0U;
+    }
+    out->buf[out->len++] = character;
+  }
+}
+
+
+static inline void _out_write_flush(out_write_type* out)
+{
+  if (out->len) {
+    _write(out->buf, out->len);
+    out->len = 0U;
+  }
+}
+
+
 // internal output function wrapper
 static inline void _out_fct(char character, void* buffer, size_t idx, size_t maxlen)
 {
@@ -880,8 +918,9 @@ int printf_(const char* format, ...)
 {
   va_list va;
   va_start(va, format);
-  char buffer[1];
-  const int ret = _vsnprintf(_out_char, buffer, (size_t)-1, format, va);
+  out_write_type out = { .len = 0U };
+  const int ret = _vsnprintf(_out_write, (char*)(uintptr_t)&out, (size_t)-1, format, va);
+  _out_write_flush(&out);
   va_end(va);
   return ret;
 }
@@ -909,8 +948,10 @@ int snprintf_(char* buffer, size_t count, const char* format, ...)
 
 int vprintf_(const char* format, va_list va)
 {
-  char buffer[1];
-  return _vsnprintf(_out_char, buffer, (size_t)-1, format, va);
+  out_write_type out = { .len = 0U };
+  const int ret = _vsnprintf(_out_write, (char*)(uintptr_t)&out, (size_t)-1, format, va);
+  _out_write_flush(&out);
+  return ret;
 }
 
 
@@ -20,8 +20,9 @@
 
 #pragma once
 
-#include "peripherals/mini_uart.h"
-#define _putchar        muart_send
+#include "drivers/console.h"
+#define _putchar        console_putc
+#define _write          console_write   // printk() hands over a buffer at a time
 
 /* Disable floating point printing */
 #define PRINTK_DISABLE_SUPPORT_FLOAT
@@ -19,10 +19,57 @@
  */
 #include "util/memorymap.h"
 #include "util/utils.h"
+#include "arch_timer.h"
 
-__attribute__((optimize(0)))
-void delay(u64 cycles)
+#define CNTKCTL_EVNTEN          BIT(2)
+#define CNTKCTL_EVNTI_SHIFT     4
+
+/* The event stream wakes WFE every EVTSTRM_PERIOD_US or so */
+#define EVTSTRM_PERIOD_US       100
+
+static u64 evtstrm_ticks; // 0 while the event stream is off
+
+/* Rounds up: never wait less than asked. Split up so that ns * freq can't overflow. */
+static inline u64 ns_to_ticks_ceil(u64 ns, u64 freq)
+{
+	return ns / NSEC_PER_SEC * freq + (ns % NSEC_PER_SEC * freq + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+}
+
+void delay_init(void)
+{
+	u64 freq = arch_timer_freq();
+	u64 period = freq / (1000000 / EVTSTRM_PERIOD_US);
+	unsigned evnti;
+	u64 cntkctl;
+
+	/* An event on every 0->1 transition of counter bit EVNTI, i.e. every
+	 * 2^(EVNTI+1) ticks; take the power of two closest to `period'.
+	 */
+	evnti = 63 - __builtin_clzll(period | 1);
+	if (evnti && period - (1UL << evnti) > (1UL << (evnti + 1)) - period)
+		evnti++;
+	evnti = evnti ? evnti - 1 : 0;
+	if (evnti > 15)
+		evnti = 15;
+
+	asm volatile ("mrs %0, cntkctl_el1" : "=r" (cntkctl));
+	cntkctl &= ~(0xFUL << CNTKCTL_EVNTI_SHIFT);
+	cntkctl |= CNTKCTL_EVNTEN | ((u64) evnti << CNTKCTL_EVNTI_SHIFT);
+	asm volatile ("msr cntkctl_el1, %0\n\tisb" :: "r" (cntkctl));
+
+	evtstrm_ticks = 2UL << evnti;
+}
+
+void ndelay(u64 ns)
 {
-	while (cycles--)
-		;
+	u64 start = arch_counter_read();
+	u64 ticks = ns_to_ticks_ceil(ns, arch_timer_freq());
+
+	/* Sleep until we're within one event of the deadline, then spin the rest */
+	if (evtstrm_ticks && ticks > 2 * evtstrm_ticks)
+		while (arch_counter_read() - start < ticks - evtstrm_ticks)
+			asm volatile ("wfe" ::: "memory");
+
+	while (arch_counter_read() - start < ticks)
+		asm volatile ("yield");
 }
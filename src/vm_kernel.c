@@ -23,12 +23,15 @@
 #include "types.h"
 #include "mmio.h"
 #include "armv8mmu.h"
+#include "fdt.h"
 #include "util/memorymap.h"
 #include "util/utils.h"
 
 // https://developer.arm.com/documentation/ddi0595/2021-12/AArch64-Registers/MAIR-EL1--Memory-Attribute-Indirection-Register--EL1-?lang=en#fieldset_0-63_0
-//#define ARMv8MMU_MAIR_KERN      0xFF // inner/outer write-back non-transient, allocating; don't test MMU with this on
-#define ARMv8MMU_MAIR_KERN      0x44 // normal memory, outer/inner non-cacheable (default behavior when MMU is off)
+/* Inner/outer write-back non-transient, allocating. The exclusives (and with them
+ * every lock) need cacheable memory for the cores to see each other's monitors.
+ */
+#define ARMv8MMU_MAIR_KERN      0xFF
 #define ARMv8MMU_MAIR_MMIO      0x0  // Device nGnRnE
 
 #define KERNEL_MAIR_IDX         1
@@ -66,6 +69,89 @@ union armv8mmu_lvl0_desc *kern_pt_base_pm =
 //union armv8mmu_lvl0_desc *kern_pt_base_vm =
 //	(union armv8mmu_lvl0_desc *) &pg_root;
 
+/* Maps the RAM in [base, base + size), trimmed to whole 2MB blocks, into the
+ * linear map. Nothing outside the range gets mapped, so the peripherals that
+ * share a GB with RAM never get a cacheable alias. A range the remaining L2
+ * tables can't cover is cut short.
+ */
+static void linear_map_range(union armv8mmu_lvl1_desc *l1, union armv8mmu_lvl2_desc *l2_pool,
+			     unsigned *l2_used, u64 base, u64 size)
+{
+	u64 start = (base + 2 * MEGABYTE - 1) & ~(2 * MEGABYTE - 1);
+	u64 end = (base + size) & ~(2 * MEGABYTE - 1);
+
+	struct armv8mmu_lvl1_block_desc gb = {
+		.valid = 1, .type = D_Block,
+		.AttrIdx = KERNEL_MAIR_IDX,
+		.NS = 1, .AP = ARMv8MMU_AP_RW,
+		.SH = 3,
+		.AF = 1, .nG = 0,
+		.PXN = 1, .XN = 1,
+	};
+	struct armv8mmu_lvl2_block_desc mb = {
+		.valid = 1, .type = D_Block,
+		.AttrIdx = KERNEL_MAIR_IDX,
+		.NS = 1, .AP = ARMv8MMU_AP_RW,
+		.SH = 3,
+		.AF = 1, .nG = 0,
+		.PXN = 1, .XN = 1,
+	};
+
+	if (end > LINEAR_MAP_MAX_PHYS)
+		end = LINEAR_MAP_MAX_PHYS;
+
+	while (start < end) {
+		union armv8mmu_lvl1_desc *desc = &l1[((armv8_vaddr) (LINEAR_MAP_VM_BASE + start)).L1];
+		u64 gb_end = (start | (GIGABYTE - 1)) + 1;
+
+		if (desc->invalid.valid && desc->block.type == D_Block) {
+			start = gb_end; // another range already covered all of it
+			continue;
+		}
+
+		if (!desc->invalid.valid && !(start & (GIGABYTE - 1)) && end >= gb_end) {
+			gb.addr_o = get_next_lvl_bits_block1((void *) start);
+			desc->block = gb;
+			start = gb_end;
+			continue;
+		}
+
+		if (!desc->invalid.valid) {
+			if (*l2_used == LINEAR_MAP_L2_TABLES)
+				return;
+
+			struct armv8mmu_lvl1_table_desc table = {
+				.valid = 1, .type = D_Table,
+				.next_addr = get_next_lvl_bits_tab(&l2_pool[*l2_used * ARMv8MMU_MAX_LVL2_TABLE_ENTRIES]),
+				.PXNTable = 1, .XNTable = 1,
+				.APTable = ARMv8MMU_AP_RW, .NSTable = 1,
+			};
+			desc->table = table;
+			(*l2_used)++;
+		}
+
+		union armv8mmu_lvl2_desc *l2 = (union armv8mmu_lvl2_desc *) ((uintptr) desc->table.next_addr << 12);
+		for (; start < end && start < gb_end; start += 2 * MEGABYTE) {
+			mb.addr_o = get_next_lvl_bits_block2((void *) start);
+			l2[((armv8_vaddr) (LINEAR_MAP_VM_BASE + start)).L2].block = mb;
+		}
+	}
+}
+
+/* Sized from the device tree, which fdt_parse() has read by now */
+static void linear_map(union armv8mmu_lvl1_desc *l1, union armv8mmu_lvl2_desc *l2_pool)
+{
+	unsigned l2_used = 0;
+
+	if (!boot_info.valid || !boot_info.nr_mem) {
+		linear_map_range(l1, l2_pool, &l2_used, 0, LINEAR_MAP_DEFAULT_SIZE);
+		return;
+	}
+
+	for (unsigned i = 0; i < boot_info.nr_mem; i++)
+		linear_map_range(l1, l2_pool, &l2_used, boot_info.mem[i].base, boot_info.mem[i].size);
+}
+
 /*
  * This function sets up and configures initial EL1&0 kernel address translation.
  * Basically it just maps the kernel image, stack, and MMIO to 3 2MB sections, respectively.
@@ -81,10 +167,13 @@ void EL2_MMU_bootstrap(void)
 	memset(kern_pt_base_pm, 0, KERN_PGDIR_SIZE);
 
 	union armv8mmu_lvl1_desc *kern_l1 =
-		(union armv8mmu_lvl1_desc *) (kern_pt_base_pm + PAGESIZE);
+		(union armv8mmu_lvl1_desc *) ((uintptr) kern_pt_base_pm + PAGESIZE);
 
 	union armv8mmu_lvl2_desc *kern_l2 =
-		(union armv8mmu_lvl2_desc *) (kern_pt_base_pm + 2 * PAGESIZE);
+		(union armv8mmu_lvl2_desc *) ((uintptr) kern_pt_base_pm + 2 * PAGESIZE);
+
+	union armv8mmu_lvl2_desc *linear_l2 =
+		(union armv8mmu_lvl2_desc *) ((uintptr) kern_pt_base_pm + 3 * PAGESIZE);
 
 	size_t table_idx;
 
@@ -108,7 +197,7 @@ void EL2_MMU_bootstrap(void)
 	table_idx = ((armv8_vaddr) KERN_VM_BASE).L1;
 	kern_l1[table_idx].table = lvl1_0;
 
-	/* level 1 pagetable #511 (used to map MMIO peripherals)
+	/* level 1 pagetable #510 (used to map MMIO peripherals)
 	 * Technically this also maps the 1GiB physical memory in which
 	 * the MMIO is contained as well (so all of phys mem on Pi 3B),
 	 * but it's a temporary solution. For testing. And will eventually
@@ -121,15 +210,21 @@ void EL2_MMU_bootstrap(void)
 		.NS = 1, .AP = ARMv8MMU_AP_RW,
 		.SH = 2, // outer shareable
 		.AF = 1, .nG = 0,
-		.addr_o = get_next_lvl_bits_block1((void *) MMIO_BASE),
+		.addr_o = get_next_lvl_bits_block1((void *) MMIO_VM_BLOCK),
 		.PXN = 1, .XN = 1,
 	};
 
-	/* map MMIO_VM_BASE to MMIO_PHYS_BASE */
-	table_idx = ((armv8_vaddr) MMIO_VM_OFFSET).L1;
-	assert(table_idx == 511);
+	/* map MMIO_VM_BASE to MMIO_VM_BLOCK */
+	table_idx = ((armv8_vaddr) MMIO_VM_BASE).L1;
+	assert(table_idx == 510);
 	kern_l1[table_idx].block = devmem;
 
+#if RASPPI <= 3
+	/* level 1 pagetable #511: ARM-local peripherals (ARM_LOCAL_BASE) */
+	devmem.addr_o = get_next_lvl_bits_block1((void *) (MMIO_VM_BLOCK + GIGABYTE));
+	kern_l1[table_idx + 1].block = devmem;
+#endif
+
 	/* 2MB block descriptor for kernel image. Can maybe consider changing this
 	 * to map .data separately, but it would require lots of tampering with
 	 * the linker script and potentially some runtime analysis to determine mappings.
@@ -138,7 +233,7 @@ void EL2_MMU_bootstrap(void)
 		.valid = 1, .type = D_Block,
 		.AttrIdx = KERNEL_MAIR_IDX,
 		.NS = 1, .AP = ARMv8MMU_AP_RW,
-		.SH = 0, /* since we are single-core, we can set this to non-shareable. */
+		.SH = 3, /* inner shareable: coherent between the cores */
 		.AF = 1, .nG = 0,
 		.addr_o = get_next_lvl_bits_block2((void *) KERN_IMG_START_PHYS),
 		.PXN = 0, .XN = 1,
@@ -149,7 +244,7 @@ void EL2_MMU_bootstrap(void)
 		.valid = 1, .type = D_Block,
 		.AttrIdx = KERNEL_MAIR_IDX,
 		.NS = 1, .AP = ARMv8MMU_AP_RW,
-		.SH = 0,
+		.SH = 3,
 		.AF = 1, .nG = 0,
 		.addr_o = get_next_lvl_bits_block2((void *) KERN_STACK_BASE_PHYS),
 		.PXN = 1, .XN = 1,
@@ -161,14 +256,31 @@ void EL2_MMU_bootstrap(void)
 //
 //	};
 
-	/* map KERN_VM_BASE to &_start (0x80000) */
+	/* map KERN_VM_BASE (and with it &_start, at 0x80000) up to the end of the image */
+	static_assert(KERNEL_IMG_MAX_SIZE % (2 * MEGABYTE) == 0);
 	table_idx = ((armv8_vaddr) KERN_VM_BASE).L2;
-	kern_l2[table_idx].block = kimg;
+	for (uintptr off = 0; off < KERNEL_IMG_MAX_SIZE; off += 2 * MEGABYTE) {
+		kimg.addr_o = get_next_lvl_bits_block2((void *) (KERN_IMG_START_PHYS + off));
+		kern_l2[table_idx++].block = kimg;
+	}
 
-	/* map kernel stack (temporary, for testing) */
+	/* map kernel stack (temporary, for testing); all CORES of them fit in here */
+	static_assert(CORE_STACK_OFFSET(CORES) <= 2 * MEGABYTE);
 	table_idx = ((armv8_vaddr) KERN_STACK_BASE_VM).L2;
 	kern_l2[table_idx].block = kstack;
 
+	/* all of RAM, for whatever needs more than the image and stacks */
+	static_assert(LINEAR_MAP_VM_BASE + LINEAR_MAP_MAX_PHYS <= MMIO_VM_BASE);
+	linear_map(kern_l1, linear_l2);
+
+	/* make sure nothing in the caches shadows the tables for the other cores */
+	asm volatile ("dsb sy" ::: "memory");
+
+	EL2_MMU_enable();
+}
+
+void EL2_MMU_enable(void)
+{
 	// setup memory attributes in MAIR
 	union armv8_mair_el1 mairEL1 = {0};
 	mairEL1.fields[KERNEL_MAIR_IDX] = ARMv8MMU_MAIR_KERN;
@@ -185,17 +297,20 @@ void EL2_MMU_bootstrap(void)
 	tcr_el1 |= (
 //		(63 - 48) | // t0 size
 		(16 << 16) | // T1SZ = 16
+		(1L << 24) | // IRGN1 = write-back, allocating (table walks)
+		(1L << 26) | // ORGN1 = write-back, allocating
+		(3L << 28) | // SH1 = inner shareable
 		//(0 << 14) | // TG0 = 4K
 		(2L << 30) // TG1 = 4K
 	); // TODO: clean this up/revisit/add #defines
 
 	asm volatile ("msr tcr_el1, %0" : : "r" (tcr_el1));
-	asm volatile ("isb" : : : "memory");
+	asm volatile ("tlbi vmalle1\n\tdsb nsh\n\tisb" : : : "memory");
 
 	u64 sctlr_el1;
 	asm volatile ("mrs %0, sctlr_el1" : "=r" (sctlr_el1));
-	sctlr_el1 &= ~(( 1<< 19) | (1<<1) | (1<<2) | (1<<12));
-	sctlr_el1 |= 1; // enable MMU
+	sctlr_el1 &= ~(( 1<< 19) | (1<<1));
+	sctlr_el1 |= 1 | (1 << 2) | (1 << 12); // enable MMU, D-cache and I-cache
 	asm volatile ("msr sctlr_el1, %0" : : "r" (sctlr_el1));
 	asm volatile ("isb" : : : "memory");
 